@@ -8,3 +8,17 @@
 inline void callback(char *buf, size_t size)
 {
 }
+
+/* PLACE YOUR BATCH CALLBACK FUNCTION HERE (OPTIONAL)
+ * This function is invoked with the requests that are ready for delivery,
+ * in delivery order. By default, it passes each request to callback.
+ *
+ * Parameters:
+ *   1) requests: Represents the requests, each of which has buf, size and timestamp.
+ *   2) count: Specifies the number of requests.
+ */
+inline void callback_batch(request_t *requests, int count)
+{
+    for (int i = 0; i < count; i++)
+        callback(requests[i].buf, requests[i].size);
+}
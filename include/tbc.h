@@ -11,6 +11,9 @@
 #define QUIET_AFTER_RESUME
 #define FORWARD                           // Resend messages to servers
 #define MULTICAST           MULTICAST_PUB // MULTICAST_PUB / MULTICAST_SUB / MULTICAST_PGM / MULTICAST_EPGM
+// #define COALESCE         64            // Packs up to n requests of a client into one frame
+// #define COMPLETION                     // Notify clients of the delivery of their requests (see tbc_api.h)
+// #define FLOW                           // Throttle clients by the credits that servers advertise
 
 // #define FUNC_TIMER
 // #define SIMU_CRASH
@@ -51,12 +54,20 @@
 
 #define SHOW_RESULT
 #define SHOW_STATUS
+// #define SHOW_POOL
+// #define SHOW_LOCKS
+// #define SHOW_FLUSH
+// #define SHOW_EV
+// #define SHOW_NACK
+// #define SHOW_OUTBOX
+// #define SHOW_PIPELINE
 // #define SHOW_PROGRESS
 
 #define EVAL_SMPL           0       // Specifies the sampling interval for evaluation, value should be 2^n - 1
 #define EVAL_INTV           100000  // Triggers evaluation after processing a specified number of requests
 #define NODE_MAX            7       // Sets the maximum number of servers that can be used
 #define HIGH_WATER_MARK     1000000 // Sets the maximum number of buffered requests
+#define CLIENT_THREADS      1       // Sets the number of client threads per host, each with its own hid
 #define DELIVER_TIMEOUT     1000000 // Sets the delivery timeout in nanoseconds
 
 #define ADDR_SIZE           128
@@ -81,9 +92,21 @@
 #error NODE_MAX > MULTICAST_MAX
 #endif
 
+#if defined(FLOW) && !defined(COMPLETION)
+#error FLOW requires COMPLETION
+#endif
+
+#if (CLIENT_THREADS > 1) && (MULTICAST != MULTICAST_PUB) && (MULTICAST != MULTICAST_PUSH)
+#error CLIENT_THREADS > 1 requires MULTICAST_PUB or MULTICAST_PUSH
+#endif
+
+#if CLIENT_THREADS > 65536
+#error CLIENT_THREADS cannot be larger than 65536
+#endif
+
 #define tree_entry list_entry
 
-typedef uint32_t hid_t;
+typedef uint64_t hid_t;
 typedef uint32_t seq_t;
 typedef uint32_t req_t;
 typedef uint32_t rep_t;
@@ -102,6 +125,12 @@ typedef struct {
     hid_t hid;
 } timestamp_t;
 
+typedef struct {
+    char *buf;
+    size_t size;
+    timestamp_t *timestamp;
+} request_t;
+
 enum {
     MULTICAST_PUB=1,
     MULTICAST_SUB,
@@ -116,11 +145,14 @@ typedef enum {
     STOP,
 } liveness_t;
 
+struct ref_msg;
+
 extern bool quiet;
 extern int node_id;
 extern int majority;
 extern int nr_nodes;
 extern int eval_intv;
+extern int batch_latency;
 extern int vector_size;
 extern bitmap_t available_nodes;
 
@@ -134,6 +166,8 @@ extern int collector_port;
 extern int heartbeat_port;
 extern int evaluator_port;
 extern int generator_port;
+extern int completion_port;
+extern int resend_port;
 
 extern char log_name[1024];
 extern char iface[IFNAME_SIZE];
@@ -143,6 +177,7 @@ extern char nodes[NODE_MAX][IPADDR_SIZE];
 
 extern session_t get_session(int id);
 extern void send_message(zmsg_t *msg);
+extern void send_ref(struct ref_msg *ref);
 extern bool get_seq_end(int id, seq_t *seq);
 extern bool get_seq_start(int id, seq_t *seq);
 extern void set_session(int id, session_t session);
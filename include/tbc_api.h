@@ -0,0 +1,31 @@
+#ifndef _TBC_API_H
+#define _TBC_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t tbc_id_t;
+
+/*
+ * Called on the thread of the library, with status 0 once the request has
+ * been delivered, -ENOENT if it will never be (a later request of the same
+ * client was delivered first, so it has expired), or -ETIMEDOUT if its
+ * completion could not be obtained, so whether it was delivered is unknown.
+ */
+typedef void (*tbc_callback_t)(tbc_id_t id, int status);
+
+/*
+ * Connects to the servers of conf/tbc.yaml as client index of this host,
+ * which has to be distinct from the indexes of the other clients on the
+ * host (tbc -c takes 0 to CLIENT_THREADS - 1) and at most 65535. The
+ * servers have to be built with COMPLETION (see tbc.h). Returns once the
+ * completions of the client can be received. At most window requests are
+ * in flight, and tbc_submit waits for a completion beyond that.
+ */
+int tbc_open(int index, int window);
+
+// Returns the id of the request, or 0 on failure (errno is ETIMEDOUT if the
+// window has stayed full for a second)
+tbc_id_t tbc_submit(const char *buf, size_t len, tbc_callback_t cb);
+
+#endif
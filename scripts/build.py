@@ -131,6 +131,8 @@ def _conf_proj():
         cflags += ' %s' % ' '.join(['-D%s' % i for i in DEFS])
     if platform.system() == 'Linux':
         cflags += ' -DLINUX'
+    if platform.machine() in ['x86_64', 'AMD64']:
+        cflags += ' -msse4.1'
     lines.append(cflags + '\n\n')
     lines.append('bin_PROGRAMS = %s\n' % INFO['name'])
 
@@ -0,0 +1,409 @@
+#include <tbc_api.h>
+#include "completion.h"
+#include "ev.h"
+#include "flow.h"
+#include "parser.h"
+#include "util.h"
+
+#define TBC_WINDOW_MAX     65536
+#define TBC_POLL_INTV      100            // msec
+#define TBC_SYNC_RETRY     10             // rounds over the nodes
+#define TBC_STALL          1000000000     // nsec
+#define TBC_EXPIRE         10000000000ULL // nsec
+#define TBC_SUBMIT_TIMEOUT 1000000000     // nsec
+
+typedef struct {
+    uint64_t sent;
+    tbc_callback_t cb;
+    timestamp_t timestamp;
+} tbc_request_t;
+
+typedef struct {
+    tbc_id_t id;
+    int status;
+    tbc_callback_t cb;
+} tbc_completion_t;
+
+// The requests in flight are the ids from done + 1 to last, and request id
+// sits in slot id % window. The completer thread expects the completion of
+// seq next, and asks the resender for the ones it has missed.
+struct {
+    int window;
+    hid_t hid;
+    seq_t next;
+    int resender;
+    uint64_t progress;
+    tbc_id_t last;
+    tbc_id_t done;
+    void *socket;
+    void *context;
+    void *desc[NODE_MAX];
+    tbc_request_t *requests;
+    tbc_completion_t *completions;
+    pthread_cond_t cond;
+    pthread_mutex_t lock;
+#ifndef COUNT
+    timeval_t t;
+#endif
+} tbc_status;
+
+#define tbc_request(id) (&tbc_status.requests[(id) % tbc_status.window])
+
+static inline uint64_t tbc_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * (uint64_t)EV_SEC + t.tv_nsec;
+}
+
+
+static inline void tbc_set_timestamp(timestamp_t *timestamp, tbc_id_t id)
+{
+    timeval_t curr;
+
+    timestamp->hid = tbc_status.hid;
+#ifdef COUNT
+    get_time(curr);
+    timestamp_set(timestamp, curr.tv_sec, id);
+#else
+    do {
+        get_time(curr);
+    } while ((curr.tv_sec == tbc_status.t.tv_sec) && (curr.tv_usec == tbc_status.t.tv_usec));
+    tbc_status.t = curr;
+    timestamp_set(timestamp, curr);
+#endif
+}
+
+
+static inline void tbc_callback(int n)
+{
+    for (int i = 0; i < n; i++)
+        if (tbc_status.completions[i].cb)
+            tbc_status.completions[i].cb(tbc_status.completions[i].id, tbc_status.completions[i].status);
+}
+
+
+// A client's requests are delivered in the order of their timestamps, so
+// if no completion has been missed, the requests in flight before a
+// completed one will never be delivered. Otherwise, they take the given
+// status, as whether they were delivered is unknown.
+static int tbc_complete(completion_t *completion, int skipped)
+{
+    int n = 0;
+
+    for (tbc_id_t id = tbc_status.done + 1; id - 1 != tbc_status.last; id++) {
+        tbc_request_t *req = tbc_request(id);
+        bool match = (req->timestamp.sec == completion->sec) && (req->timestamp.usec == completion->usec);
+
+        tbc_status.completions[n].id = id;
+        tbc_status.completions[n].cb = req->cb;
+        tbc_status.completions[n].status = match ? 0 : skipped;
+        n++;
+        if (match) {
+            tbc_status.done = id;
+            return n;
+        }
+    }
+    return 0;
+}
+
+
+// Applies the completions from seq, skipping the ones already applied. The
+// completions missed before seq, if any, settle the requests they might
+// belong to with skipped.
+static void tbc_apply(seq_t seq, completion_t *completions, int count, int skipped)
+{
+    for (int i = 0; i < count; i++, seq++) {
+        int n;
+
+        if (seq < tbc_status.next)
+            continue;
+        pthread_mutex_lock(&tbc_status.lock);
+        n = tbc_complete(&completions[i], skipped);
+        if (n)
+            tbc_status.progress = tbc_now();
+        tbc_status.next = seq + 1;
+        pthread_cond_broadcast(&tbc_status.cond);
+        pthread_mutex_unlock(&tbc_status.lock);
+        tbc_callback(n);
+        skipped = -ENOENT;
+    }
+}
+
+
+// Returns the size of the reply of node id to a resend request from seq,
+// or -1 if it cannot be reached
+static int tbc_resend(int id, seq_t seq, char *buf)
+{
+    int ret = -1;
+    int linger = 0;
+    int timeout = TBC_POLL_INTV;
+    char addr[ADDR_SIZE];
+    completion_hdr_t req;
+    void *socket = zmq_socket(tbc_status.context, ZMQ_REQ);
+
+    req.hid = tbc_status.hid;
+    req.seq = seq;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    tcpaddr(addr, nodes[id], resend_port);
+    if (!zmq_connect(socket, addr) && (zmq_send(socket, &req, sizeof(completion_hdr_t), 0) == sizeof(completion_hdr_t)))
+        ret = zmq_recv(socket, buf, COMPLETION_FRAME_SIZE, 0);
+    zmq_close(socket);
+    if ((ret < (int)sizeof(completion_hdr_t)) || (((completion_hdr_t *)buf)->hid != tbc_status.hid))
+        return -1;
+    return ret;
+}
+
+
+// Asks for the completions missed from next on, until the one before end
+// has been applied, or until there are no more if end is 0. A node that
+// cannot be reached, or that has not delivered them yet, is left for the
+// next one. Returns false if no node could provide them.
+static bool tbc_recover(seq_t end)
+{
+    int failures = 0;
+    char buf[COMPLETION_FRAME_SIZE];
+    completion_hdr_t *hdr = (completion_hdr_t *)buf;
+
+    while (!end || (tbc_status.next < end)) {
+        int count;
+        int ret = tbc_resend(tbc_status.resender, tbc_status.next, buf);
+
+        count = ret < 0 ? 0 : (ret - sizeof(completion_hdr_t)) / sizeof(completion_t);
+        if (!count) {
+            if ((ret >= 0) && !end)
+                return true;
+            tbc_status.resender = (tbc_status.resender + 1) % nr_nodes;
+            if (++failures == nr_nodes)
+                return false;
+            continue;
+        }
+        failures = 0;
+        // the node no longer keeps the completions from next on
+        tbc_apply(hdr->seq, (completion_t *)(buf + sizeof(completion_hdr_t)), count,
+                  hdr->seq > tbc_status.next ? -ETIMEDOUT : -ENOENT);
+    }
+    return true;
+}
+
+
+// Requests in flight for TBC_EXPIRE are given up
+static void tbc_expire(uint64_t now)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&tbc_status.lock);
+    while (tbc_status.done != tbc_status.last) {
+        tbc_request_t *req = tbc_request(tbc_status.done + 1);
+
+        if (now - req->sent < TBC_EXPIRE)
+            break;
+        tbc_status.done++;
+        tbc_status.completions[n].id = tbc_status.done;
+        tbc_status.completions[n].cb = req->cb;
+        tbc_status.completions[n].status = -ETIMEDOUT;
+        n++;
+    }
+    if (n)
+        pthread_cond_broadcast(&tbc_status.cond);
+    pthread_mutex_unlock(&tbc_status.lock);
+    tbc_callback(n);
+}
+
+
+// Without completions for TBC_STALL while requests are in flight, the last
+// frames may have been lost or the completer may have failed, so the
+// missed completions are asked for
+static void tbc_check()
+{
+    bool stalled;
+    uint64_t now = tbc_now();
+
+    pthread_mutex_lock(&tbc_status.lock);
+    stalled = (tbc_status.done != tbc_status.last) && (now - tbc_status.progress >= TBC_STALL);
+    if (stalled)
+        tbc_status.progress = now;
+    pthread_mutex_unlock(&tbc_status.lock);
+    if (stalled) {
+        tbc_recover(0);
+        tbc_expire(now);
+    }
+}
+
+
+void *tbc_completer(void *arg)
+{
+    while (true) {
+        zmsg_t *msg = zmsg_recv(tbc_status.socket);
+
+        if (msg) {
+            completion_hdr_t hdr;
+            zframe_t *frame = zmsg_first(msg);
+            char *buf = (char *)zframe_data(frame);
+            size_t size = zframe_size(frame);
+
+            if (size >= sizeof(completion_hdr_t)) {
+                memcpy(&hdr, buf, sizeof(completion_hdr_t));
+                if ((hdr.hid == tbc_status.hid) && (size > sizeof(completion_hdr_t))) {
+                    int count = (size - sizeof(completion_hdr_t)) / sizeof(completion_t);
+                    int skipped = -ENOENT;
+
+                    // the nodes have forgotten the client after COMPLETION_TTL
+                    if ((1 == hdr.seq) && (tbc_status.next > 1))
+                        tbc_status.next = 1;
+                    if ((hdr.seq > tbc_status.next) && !tbc_recover(hdr.seq))
+                        skipped = -ETIMEDOUT;
+                    tbc_apply(hdr.seq, (completion_t *)(buf + sizeof(completion_hdr_t)), count, skipped);
+                }
+            }
+            zmsg_destroy(&msg);
+        }
+        tbc_check();
+    }
+    return NULL;
+}
+
+
+// Takes the next seq from a node and waits for the empty frame it publishes
+// in return, which shows that the subscription has reached the node
+static int tbc_sync()
+{
+    char buf[COMPLETION_FRAME_SIZE];
+
+    for (int i = 0; i < TBC_SYNC_RETRY * nr_nodes; i++) {
+        zmsg_t *msg;
+        int id = (get_completer(tbc_status.hid) + i) % nr_nodes;
+
+        if (tbc_resend(id, COMPLETION_SYNC, buf) < 0)
+            continue;
+        tbc_status.next = ((completion_hdr_t *)buf)->seq;
+        tbc_status.resender = id;
+        while ((msg = zmsg_recv(tbc_status.socket))) {
+            zframe_t *frame = zmsg_first(msg);
+            bool synced = (zframe_size(frame) >= sizeof(completion_hdr_t))
+                && (((completion_hdr_t *)zframe_data(frame))->hid == tbc_status.hid);
+
+            zmsg_destroy(&msg);
+            if (synced)
+                return 0;
+        }
+    }
+    return -ETIMEDOUT;
+}
+
+
+// Sends the request to every server, as the client of tbc does
+tbc_id_t tbc_submit(const char *buf, size_t len, tbc_callback_t cb)
+{
+    tbc_id_t id;
+    tbc_request_t *req;
+    struct timespec deadline;
+
+    if (!tbc_status.requests)
+        return 0;
+#ifdef FLOW
+    flow_wait();
+#endif
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TBC_SUBMIT_TIMEOUT / EV_SEC;
+    deadline.tv_nsec += TBC_SUBMIT_TIMEOUT % EV_SEC;
+    if (deadline.tv_nsec >= EV_SEC) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= EV_SEC;
+    }
+    pthread_mutex_lock(&tbc_status.lock);
+    while (tbc_status.last - tbc_status.done >= tbc_status.window) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&tbc_status.cond, &tbc_status.lock, &deadline)) {
+            pthread_mutex_unlock(&tbc_status.lock);
+            errno = ETIMEDOUT;
+            return 0;
+        }
+    }
+    id = ++tbc_status.last;
+    req = tbc_request(id);
+    req->cb = cb;
+    req->sent = tbc_now();
+    if (id - 1 == tbc_status.done)
+        tbc_status.progress = req->sent;
+    tbc_set_timestamp(&req->timestamp, id);
+    for (int i = 0; i < nr_nodes; i++) {
+        if ((zmq_send(tbc_status.desc[i], &req->timestamp, sizeof(timestamp_t), ZMQ_SNDMORE) < 0)
+            || (zmq_send(tbc_status.desc[i], buf, len, 0) < 0))
+            log_debug("failed to send to %s", nodes[i]);
+    }
+    pthread_mutex_unlock(&tbc_status.lock);
+    return id;
+}
+
+
+int tbc_open(int index, int window)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    char addr[ADDR_SIZE];
+    int timeout = TBC_POLL_INTV;
+#ifdef HIGH_WATER_MARK
+    int hwm = HIGH_WATER_MARK;
+#endif
+    if ((window <= 0) || (window > TBC_WINDOW_MAX) || (index < 0) || (index > HID_INDEX_MAX) || tbc_status.requests)
+        return -EINVAL;
+    if (parse() || (-1 == completion_port) || (-1 == resend_port)) {
+        log_debug("invalid settings");
+        return -EINVAL;
+    }
+    tbc_status.completions = calloc(window, sizeof(tbc_completion_t));
+    if (!tbc_status.completions) {
+        log_debug("no memory");
+        return -ENOMEM;
+    }
+    tbc_status.window = window;
+    tbc_status.hid = index2hid(get_addr(), index);
+    tbc_status.last = 0;
+    tbc_status.done = 0;
+    pthread_cond_init(&tbc_status.cond, NULL);
+    pthread_mutex_init(&tbc_status.lock, NULL);
+    tbc_status.context = zmq_ctx_new();
+    for (int i = 0; i < nr_nodes; i++) {
+        tbc_status.desc[i] = zmq_socket(tbc_status.context, ZMQ_PUSH);
+#ifdef HIGH_WATER_MARK
+        zmq_setsockopt(tbc_status.desc[i], ZMQ_SNDHWM, &hwm, sizeof(hwm));
+#endif
+        tcpaddr(addr, nodes[i], generator_port);
+        if (zmq_connect(tbc_status.desc[i], addr)) {
+            log_debug("failed to connect to %s", addr);
+            return -EINVAL;
+        }
+    }
+    // the completer of the client changes when a node fails
+    tbc_status.socket = zmq_socket(tbc_status.context, ZMQ_SUB);
+    zmq_setsockopt(tbc_status.socket, ZMQ_SUBSCRIBE, &tbc_status.hid, sizeof(hid_t));
+    zmq_setsockopt(tbc_status.socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < nr_nodes; i++) {
+        tcpaddr(addr, nodes[i], completion_port);
+        if (zmq_connect(tbc_status.socket, addr)) {
+            log_debug("failed to connect to %s", addr);
+            return -EINVAL;
+        }
+    }
+    if (tbc_sync()) {
+        log_debug("failed to subscribe to completions");
+        free(tbc_status.completions);
+        return -ETIMEDOUT;
+    }
+    tbc_status.requests = calloc(window, sizeof(tbc_request_t));
+    if (!tbc_status.requests) {
+        log_debug("no memory");
+        return -ENOMEM;
+    }
+#ifdef FLOW
+    flow_connect();
+#endif
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, tbc_completer, NULL);
+    pthread_attr_destroy(&attr);
+    return 0;
+}
@@ -3,11 +3,26 @@
 #include "requester.h"
 #include "evaluator.h"
 #include "subscriber.h"
+#include "wire.h"
+#include "flow.h"
 
 #ifdef EVAL_ECHO
 #define CLI_EVAL
 #endif
 
+#ifdef COALESCE
+#define CLIENT_COALESCE_SIZE 65536   // bytes
+#define CLIENT_COALESCE_WAIT 1       // msec
+
+static __thread struct {
+    int count;
+    size_t size;
+    size_t length;
+    char *buf;
+    timeval_t start;
+} client_coalesce_status;
+#endif
+
 #ifdef CLI_EVAL
 #include "verify.h"
 #include "evaluator.h"
@@ -19,20 +34,28 @@ struct {
     uint64_t latency;
 } client_status;
 
+// The evaluator of every client thread learns the address of the listener
 void client_connect_evaluator()
 {
     rep_t rep;
     req_t req;
+    bitmap_t connected = 0;
     char addr[ADDR_SIZE];
     struct in_addr src = get_addr();
-    int evaluator = get_evaluator(get_hid());
 
     memcpy(&req, &src, sizeof(req_t));
-    tcpaddr(addr, nodes[evaluator], evaluator_port);
-    if (request(addr, &req, &rep))
-        log_err("cannot connect to evaluator");
-    else
-        log_func("connect to %s", nodes[evaluator]);
+    for (int i = 0; i < CLIENT_THREADS; i++) {
+        int evaluator = get_evaluator(index2hid(src, i));
+
+        if (connected & node_mask[evaluator])
+            continue;
+        tcpaddr(addr, nodes[evaluator], evaluator_port);
+        if (request(addr, &req, &rep))
+            log_err("cannot connect to evaluator");
+        else
+            log_func("connect to %s", nodes[evaluator]);
+        connected |= node_mask[evaluator];
+    }
 }
 
 
@@ -107,17 +130,18 @@ static inline zmsg_t *client_add_timestamp(zmsg_t *msg)
 {
     timeval_t curr;
     zframe_t *frame;
-    static bool init = false;
-    static timestamp_t timestamp;
+    static __thread bool init = false;
+    static __thread timestamp_t timestamp;
     timestamp_t *ptimestamp = &timestamp;
 #ifdef COUNT
-    static uint32_t count = 0;
-    static uint32_t sec = 0;
+    static __thread uint32_t count = 0;
+    static __thread uint32_t sec = 0;
 #else
-    static timeval_t t;
+    static __thread timeval_t t;
 #endif
+    // client thread i stamps its requests with the hid of index i
     if (!init) {
-        timestamp.hid = get_hid();
+        timestamp.hid = index2hid(get_addr(), publisher_get_index());
         init = true;
     }
 #ifdef COUNT
@@ -144,13 +168,92 @@ static inline zmsg_t *client_add_timestamp(zmsg_t *msg)
 }
 
 
+#ifdef COALESCE
+// Requests are packed after WIRE_HEADER_MAX bytes, so that the header can
+// be put right before them once the count is known.
+static inline zmsg_t *client_flush()
+{
+    zmsg_t *msg;
+    zframe_t *frame;
+    char hdr[WIRE_HEADER_MAX];
+    size_t len = wire_pack_requests(hdr, client_coalesce_status.count);
+    char *start = client_coalesce_status.buf + WIRE_HEADER_MAX - len;
+
+    if (!client_coalesce_status.count)
+        return NULL;
+    memcpy(start, hdr, len);
+    frame = zframe_new(start, len + client_coalesce_status.length);
+    msg = zmsg_new();
+    zmsg_prepend(msg, &frame);
+    client_coalesce_status.count = 0;
+    client_coalesce_status.length = 0;
+    return msg;
+}
+
+
+// Returns a frame of requests once COALESCE of them are packed, once they
+// fill CLIENT_COALESCE_SIZE bytes, or once the oldest has waited for
+// CLIENT_COALESCE_WAIT (msg is NULL if nothing arrived in the meantime).
+static inline zmsg_t *client_coalesce(zmsg_t *msg)
+{
+    char *p;
+    size_t size;
+    timeval_t now;
+
+    get_time(now);
+    if (!msg)
+        return client_flush();
+    msg = client_add_timestamp(msg);
+    size = WIRE_HEADER_MAX + client_coalesce_status.length + wire_msg_size(msg);
+    if (size > client_coalesce_status.size) {
+        char *buf = realloc(client_coalesce_status.buf, size);
+
+        if (!buf) {
+            log_err("no memory");
+            return NULL;
+        }
+        client_coalesce_status.buf = buf;
+        client_coalesce_status.size = size;
+    }
+    if (!client_coalesce_status.count)
+        client_coalesce_status.start = now;
+    p = client_coalesce_status.buf + WIRE_HEADER_MAX;
+    client_coalesce_status.length = wire_put_msg(p + client_coalesce_status.length, msg) - p;
+    client_coalesce_status.count++;
+    zmsg_destroy(&msg);
+    if ((client_coalesce_status.count == COALESCE) || (client_coalesce_status.length >= CLIENT_COALESCE_SIZE)
+        || (time_diff(&client_coalesce_status.start, &now) >= CLIENT_COALESCE_WAIT * 1000))
+        return client_flush();
+    return NULL;
+}
+#endif
+
+
 zmsg_t *client_set_msg(zmsg_t *msg)
 {
+#ifdef FLOW
+    if (msg)
+        flow_wait();
+#endif
+#ifdef COALESCE
+    return client_coalesce(msg);
+#else
     return client_add_timestamp(msg);
+#endif
 }
 
 
-int client_create()
+// Client thread i takes requests from TBC_ADDR, or from TBC_ADDR_i if i > 0
+static inline void client_addr(char *dest, const char *addr, int index)
+{
+    if (index)
+        sprintf(dest, "%s_%d", addr, index);
+    else
+        strcpy(dest, addr);
+}
+
+
+int client_create_publisher(int index)
 {
     pub_arg_t *arg;
     pthread_t thread;
@@ -161,9 +264,10 @@ int client_create()
         log_err("no memory");
         return -ENOMEM;
     }
-    strcpy(arg->src, TBC_ADDR);
+    arg->index = index;
+    client_addr(arg->src, TBC_ADDR, index);
     if (MULTICAST == MULTICAST_PUB)
-        strcpy(arg->addr, CLIENT_ADDR);
+        client_addr(arg->addr, CLIENT_ADDR, index);
     else if (MULTICAST == MULTICAST_SUB)
         tcpaddr(arg->addr, inet_ntoa(get_addr()), client_port);
     else if (MULTICAST == MULTICAST_PGM)
@@ -174,11 +278,29 @@ int client_create()
         tcpaddr(arg->dest[i], nodes[i], generator_port);
     arg->total = nr_nodes;
     arg->callback = client_set_msg;
+#ifdef COALESCE
+    arg->timeout = CLIENT_COALESCE_WAIT;
+#endif
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
     pthread_create(&thread, &attr, publisher_start, arg);
     pthread_attr_destroy(&attr);
+    return 0;
+}
+
+
+int client_create()
+{
+#ifdef FLOW
+    flow_connect();
+#endif
+    for (int i = 0; i < CLIENT_THREADS; i++) {
+        int ret = client_create_publisher(i);
+
+        if (ret)
+            return ret;
+    }
 #ifdef CLI_EVAL
     client_status.cnt = 0;
     client_status.init = false;
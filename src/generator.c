@@ -7,21 +7,27 @@
 #include "publisher.h"
 #include "subscriber.h"
 #include "tracker.h"
+#include "wire.h"
 #ifdef VERIFY
 #include "verify.h"
 #endif
 
 #define GENERATOR_QUEUE_LEN 1000000
+#define GENERATOR_ACTIVE    0x01
+#define GENERATOR_FILTER    0x02
 
 typedef struct {
     zmsg_t *msg;
     struct list_head list;
 } generator_record_t;
 
+// The state is only changed under the lock, while an active generator
+// handles messages without it. Those in flight are counted, so that a
+// suspend can wait for them to finish.
 struct {
     int count;
-    bool active;
-    bool filter;
+    int state;
+    int inflight;
     sender_desc_t desc;
     pthread_cond_t cond;
     pthread_mutex_t lock;
@@ -31,6 +37,10 @@ struct {
 } generator_status;
 
 #define generator_need_save() (!generator_status.t_filter.sec || !generator_status.t_filter.usec)
+#define generator_is_active() (generator_status.state & GENERATOR_ACTIVE)
+#define generator_is_filtering() (generator_status.state & GENERATOR_FILTER)
+#define generator_set_state(bits) __atomic_or_fetch(&generator_status.state, bits, __ATOMIC_SEQ_CST)
+#define generator_clear_state(bits) __atomic_and_fetch(&generator_status.state, ~(bits), __ATOMIC_SEQ_CST)
 
 void send_message(zmsg_t *msg)
 {
@@ -38,6 +48,12 @@ void send_message(zmsg_t *msg)
 }
 
 
+void send_ref(struct ref_msg *ref)
+{
+    publish_ref(&generator_status.desc, ref);
+}
+
+
 inline void generator_lock()
 {
     pthread_mutex_lock(&generator_status.lock);
@@ -50,6 +66,22 @@ inline void generator_unlock()
 }
 
 
+static inline bool generator_enter()
+{
+    __atomic_add_fetch(&generator_status.inflight, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&generator_status.state, __ATOMIC_SEQ_CST) == GENERATOR_ACTIVE)
+        return true;
+    __atomic_sub_fetch(&generator_status.inflight, 1, __ATOMIC_RELEASE);
+    return false;
+}
+
+
+static inline void generator_exit()
+{
+    __atomic_sub_fetch(&generator_status.inflight, 1, __ATOMIC_RELEASE);
+}
+
+
 inline int generator_time_compare(host_time_t *t1, host_time_t *t2)
 {
     if (t1->sec > t2->sec)
@@ -79,8 +111,10 @@ void generator_suspend()
 {
     crash_details("start");
     generator_lock();
-    generator_status.active = false;
+    generator_clear_state(GENERATOR_ACTIVE);
     generator_unlock();
+    while (__atomic_load_n(&generator_status.inflight, __ATOMIC_SEQ_CST))
+        sched_yield();
     crash_details("finished!");
 }
 
@@ -115,7 +149,6 @@ void generator_resume()
 
     crash_details("start");
     generator_lock();
-    generator_status.active = true;
     memset(&generator_status.t_filter, 0, sizeof(host_time_t));
     list_for_each_entry_safe(rec, next, &generator_status.queue, list) {
         zmsg_t *msg = rec->msg;
@@ -126,6 +159,8 @@ void generator_resume()
         free(rec);
     }
     generator_status.count = 0;
+    // the saved messages go first, then the fast path is open again
+    generator_set_state(GENERATOR_ACTIVE);
     generator_unlock();
     crash_details("finished!");
 }
@@ -136,7 +171,7 @@ void generator_start_filter(host_time_t bound)
     log_func("bound=<sec: %d, usec: %d>, session=%d", bound.sec, bound.usec, get_session(node_id));
     generator_lock();
     generator_status.t_filter = bound;
-    generator_status.filter = true;
+    generator_set_state(GENERATOR_FILTER);
     generator_unlock();
     generator_wakeup();
 }
@@ -146,7 +181,7 @@ void generator_stop_filter()
 {
     log_func("session=%d", get_session(node_id));
     generator_lock();
-    generator_status.filter = false;
+    generator_clear_state(GENERATOR_FILTER);
     generator_unlock();
     generator_wakeup();
 }
@@ -163,10 +198,16 @@ zmsg_t *generator_check_msg(zmsg_t *msg)
 {
     bool active;
     host_time_t *t = (host_time_t *)get_timestamp(msg);
+
+    if (generator_enter()) {
+        generator_do_handle(msg);
+        generator_exit();
+        return NULL;
+    }
 retry:
     generator_lock();
-    active = generator_status.active;
-    if (active || (generator_status.filter && (generator_time_compare(&generator_status.t_filter, t) >= 0)))
+    active = generator_is_active();
+    if (active || (generator_is_filtering() && (generator_time_compare(&generator_status.t_filter, t) >= 0)))
         generator_do_handle(msg);
     else {
         if (generator_need_save()) {
@@ -198,8 +239,44 @@ void generator_handle(int id, zmsg_t *msg)
 }
 
 
+#ifdef COALESCE
+// The requests of a coalesced frame go to batch together while the generator
+// is active, and one by one otherwise. Each request is copied into a message
+// of its own, as a record keeps its message until it is reclaimed and czmq
+// has no stable way to build frames over a slice of another one, so the
+// frame saves sends and wakeups on the way here rather than allocations.
+zmsg_t *generator_split_msg(zmsg_t *msg)
+{
+    int count = COALESCE;
+    zmsg_t *msgs[COALESCE];
+    zframe_t *frame = zmsg_first(msg);
+    int ret = wire_unpack_requests((char *)zframe_data(frame), zframe_size(frame), msgs, &count);
+
+    zmsg_destroy(&msg);
+    if (ret)
+        return NULL;
+#ifdef VERIFY
+    for (int i = 0; i < count; i++)
+        verify_input(msgs[i]);
+#endif
+    if (generator_enter()) {
+        batch_bulk(msgs, count);
+        generator_exit();
+        return NULL;
+    }
+    for (int i = 0; i < count; i++)
+        generator_check_msg(msgs[i]);
+    return NULL;
+}
+#endif
+
+
 zmsg_t *generator_set_msg(zmsg_t *msg)
 {
+#ifdef COALESCE
+    if (is_batched(msg))
+        return generator_split_msg(msg);
+#endif
 #ifdef VERIFY
     verify_input(msg);
 #endif
@@ -263,8 +340,8 @@ void generator_init()
 {
     batch_init();
     generator_status.count = 0;
-    generator_status.active = true;
-    generator_status.filter = false;
+    generator_status.state = GENERATOR_ACTIVE;
+    generator_status.inflight = 0;
     INIT_LIST_HEAD(&generator_status.queue);
     pthread_cond_init(&generator_status.cond, NULL);
     pthread_mutex_init(&generator_status.lock, NULL);
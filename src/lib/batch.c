@@ -1,27 +1,46 @@
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
 #include "ev.h"
+#include "timer.h"
+#include "ref.h"
+#include "pool.h"
 #include "batch.h"
+#include "index.h"
+#include "record.h"
+#include "wire.h"
 #include "verify.h"
 #include "tracker.h"
 
 #define BATCH_DEP_MTX
 // #define BATCH_FAST_UPDATE
 
-#define BATCH_MAX           100           // msg
+#define BATCH_MIN           1             // msg
+#define BATCH_MAX           1000          // msg
+#define BATCH_LATENCY       500           // usec
 #define BATCH_SEND_INTV     10000         // nsec
-#define BATCH_CHECK_INTV    1000          // nsec
-#define BATCH_RECYCLE_INTV  1000          // nsec
-#define BATCH_FORWARD_INTV  10000000      // usec
+#define BATCH_RATE_SHIFT    3
+#define BATCH_KICK_INTV     1000000       // nsec
+#define BATCH_NACK_DELAY    5000000       // nsec
+#define BATCH_NACK_MAX      256           // timestamps
 #define BATCH_CLEAN_INTV    EV_NOTIMEOUT
 #define BATCH_NR_TIMESTAMPS (BATCH_MAX + 10000)
+#define BATCH_BULK_MAX      256
+#define BATCH_WIRE_REFRESH  64            // frames
+#define BATCH_WIRE_SIZE     wire_size_max(NODE_MAX * NODE_MAX, BATCH_NR_TIMESTAMPS)
+#define BATCH_PREFETCH_DIST 8
+#define BATCH_RETIRE_MAX    256
+#define BATCH_RING_SIZE     4096          // records, must be a power of 2
 
 #define batch_list_del list_del
+#define batch_lock_wait(type, lock, trylock, func) do { \
+    if (trylock(lock)) { \
+        __sync_fetch_and_add(&batch_status.waits[type], 1); \
+        func(lock); \
+    } \
+} while (0)
 #define batch_list_add assert_list_add_tail
 
-#define batch_tree_create rb_tree_new
-#define batch_node_lookup rb_tree_find
-#define batch_node_remove rb_tree_remove
-#define batch_node_insert rb_tree_insert
-
 #define batch_prev batch_status.prev
 #define batch_tail batch_status.tail
 #define batch_total batch_status.total
@@ -30,33 +49,58 @@
 #define batch_matrix batch_status.matrix
 #define batch_ev_send batch_status.ev_send
 #define batch_progress batch_status.progress
+#define batch_checked batch_status.checked
 #define batch_sessions batch_status.sessions
 #define batch_pkt_header batch_status.pkt_header
 #define batch_ev_recycle batch_status.ev_recycle
 #define batch_ev_cleaner batch_status.ev_cleaner
 #define batch_ev_checker batch_status.ev_checker
+#define batch_watermark batch_status.watermark
+#define batch_clean_mark batch_status.clean
 #define batch_dep batch_timestamps.pkt_header.dep
 #define batch_count batch_timestamps.pkt_header.count
 #define batch_session batch_timestamps.pkt_header.session
-#define batch_recycle_counter batch_status.recycle_counter
+#define batch_entry(ptr) list_entry(ptr, batch_record_t, entry)
+#define batch_ring_slot(ring, seq) ((seq) & ((ring)->size - 1))
+#define batch_ring_empty(ring) ((ring)->base == (ring)->end)
+#define batch_record_msg(rec) ((rec)->ref ? (rec)->ref->msg : NULL)
+#define batch_target batch_status.target
+#define batch_oldest batch_status.oldest
+#define batch_flushes batch_status.flushes
+#define batch_nr_cells (batch_dep_size / (int)sizeof(seq_t))
+#define batch_latency_budget() (batch_latency > 0 ? batch_latency : BATCH_LATENCY)
 #define batch_record_has_receiver(rec, id) ((rec)->receivers & node_mask[id])
-#define batch_record_set_receiver(rec, id) ((rec)->receivers |= node_mask[id])
+#define batch_record_set_receiver(rec, id) __sync_fetch_and_or(&(rec)->receivers, node_mask[id])
 #define batch_clean_complete(rec) (((rec)->clean & available_nodes) == available_nodes)
 #define batch_receive_complete(rec) (((rec)->receivers & available_nodes) == available_nodes)
+#define batch_record_released(rec) ((rec)->recycle.next == &(rec)->recycle)
 #ifdef BATCH_DEP_MTX
 #define batch_dep_matrix batch_status.dep_matrix
 #endif
 
-typedef rbtree_t batch_tree_t;
 typedef uint32_t batch_version_t;
-typedef rbtree_node_t batch_node_t;
 typedef struct list_head batch_list_t;
 
 typedef enum {
-    BATCH_TIMEOUT_INIT = 0,
-    BATCH_TIMEOUT_SET,
-    BATCH_TIMEOUT_CLEAR,
-} batch_timeout_t;
+    BATCH_LOCK_PACK = 0,
+    BATCH_LOCK_LIST,
+    BATCH_LOCK_SESSION,
+    NR_BATCH_LOCKS,
+} batch_lock_type_t;
+
+typedef enum {
+    BATCH_NACK_SENT = 0,
+    BATCH_NACK_RECEIVED,
+    BATCH_NACK_RETX,
+    NR_BATCH_NACKS,
+} batch_nack_stat_t;
+
+typedef enum {
+    BATCH_FLUSH_SIZE = 0,
+    BATCH_FLUSH_DEADLINE,
+    BATCH_FLUSH_DEP,
+    NR_BATCH_FLUSHES,
+} batch_flush_t;
 
 typedef struct {
     seq_t dep[NODE_MAX * NODE_MAX];
@@ -65,42 +109,79 @@ typedef struct {
 } batch_pkt_header_t;
 
 typedef struct batch_record {
-    zmsg_t *msg;
+    ref_msg_t *ref;
     bitmap_t clean;
     timestamp_t ts;
-    batch_node_t node;
+    index_entry_t entry;
     bitmap_t receivers;
     seq_t seq[NODE_MAX];
     batch_list_t recycle;
     bool visible[NODE_MAX];
     timestamp_t *timestamp;
-    batch_list_t list[NODE_MAX];
-#ifdef FORWARD
-    batch_timeout_t timeout;
-#endif
 } batch_record_t;
 
+// Timestamps requested from a peer (or by a peer), which the sender
+// packs into a single frame per peer.
+typedef struct batch_nack {
+    int count;
+    timestamp_t timestamps[BATCH_NACK_MAX];
+} batch_nack_t;
+
+// The records of an origin indexed by seq, where the slots from base to end
+// are either records or holes left by recycled records. The timestamps are
+// copied alongside so that a range of seqs can be exported with memcpy.
+typedef struct batch_ring {
+    seq_t base;
+    seq_t end;
+    seq_t size;
+    batch_record_t **records;
+    timestamp_t *timestamps;
+} batch_ring_t;
+
 struct {
     int bufsz;
     int total;
+    int target;
     ev_t ev_send;
+    uint64_t rate;
+    uint64_t oldest;
+    uint64_t arrival;
+    uint64_t packed;
     timeval_t time;
     ev_t ev_recycle;
-    ev_t ev_cleaner;
-    ev_t ev_checker;
+    ev_t ev_cleaner[NODE_MAX];
+    ev_t ev_checker[NODE_MAX];
+    bool kicking;
+    timer_task_t *kick;
+    bool nacking;
+    bool nack_pending;
+    timer_task_t *nack;
+    pthread_mutex_t nack_lock;
+    batch_nack_t nack_out[NODE_MAX];
+    batch_nack_t nack_in[NODE_MAX];
+    uint64_t nacks[NR_BATCH_NACKS];
+    char nack_wire[wire_nack_size_max(BATCH_NACK_MAX)];
     seq_t *progress;
     char *pkt_header;
-    batch_tree_t tree;
-    int recycle_counter;
-    batch_list_t recycle;
-    pthread_rwlock_t lock;
+    pthread_mutex_t pack_lock;
     seq_t *matrix[NODE_MAX];
-    batch_list_t head[NODE_MAX];
-    batch_list_t *tail[NODE_MAX];
-    batch_list_t *prev[NODE_MAX];
+    seq_t checked[NODE_MAX];
+    seq_t clean[NODE_MAX];
+    seq_t tail[NODE_MAX];
+    seq_t prev[NODE_MAX];
+    seq_t watermark[NODE_MAX];
+    batch_ring_t rings[NODE_MAX];
     session_t sessions[NODE_MAX];
-    pthread_mutex_t recycle_lock;
+    uint64_t waits[NR_BATCH_LOCKS];
+    uint64_t frames;
+    session_t sent_session;
+    uint64_t flushes[NR_BATCH_FLUSHES];
+    char wire[BATCH_WIRE_SIZE];
+    seq_t sent[NODE_MAX * NODE_MAX];
+    seq_t rx_dep[NODE_MAX][NODE_MAX * NODE_MAX];
+    timestamp_t rx[NODE_MAX][BATCH_NR_TIMESTAMPS];
     pthread_rwlock_t list_locks[NODE_MAX];
+    pthread_mutex_t session_locks[NODE_MAX];
 #ifdef BATCH_DEP_MTX
     seq_t *dep_matrix[NODE_MAX][NODE_MAX];
     seq_t dep[NODE_MAX][NODE_MAX * NODE_MAX];
@@ -117,57 +198,155 @@ struct {
 int batch_row_size = -1;
 int batch_dep_size = -1;
 int batch_pkt_header_off = -1;
-int batch_pkt_header_size = -1;
 
-inline void batch_wrlock();
-inline void batch_rdlock();
-inline void batch_unlock();
+inline void batch_pack_lock();
+inline void batch_pack_unlock();
+inline void batch_session_lock(int id);
+inline void batch_session_unlock(int id);
+inline void batch_list_rdlock(int id);
+inline void batch_list_unlock(int id);
 static inline void batch_release(batch_record_t *rec);
-static inline void batch_add(int id, timestamp_t *timestamp, zmsg_t *msg);
+static inline bool batch_update_watermark(int id);
+static inline void batch_add_bulk(int id, timestamp_t *timestamps, int count);
+
+// An event is consumed by a single waiter, so each checker and each cleaner
+// waits on its own event and a change wakes the ones of every origin
+static inline void batch_wake(ev_t *evs)
+{
+    for (int i = 0; i < nr_nodes; i++)
+        ev_set(&evs[i]);
+}
+
+
+static inline void batch_ring_init(batch_ring_t *ring)
+{
+    ring->base = 1;
+    ring->end = 1;
+    ring->size = BATCH_RING_SIZE;
+    ring->records = calloc(ring->size, sizeof(batch_record_t *));
+    ring->timestamps = malloc(ring->size * sizeof(timestamp_t));
+    if (!ring->records || !ring->timestamps)
+        log_err("no memory");
+}
+
+
+static inline batch_record_t *batch_ring_get(batch_ring_t *ring, seq_t seq)
+{
+    if ((seq < ring->base) || (seq >= ring->end))
+        return NULL;
+    return ring->records[batch_ring_slot(ring, seq)];
+}
+
+
+static inline void batch_ring_grow(batch_ring_t *ring)
+{
+    seq_t size = ring->size * 2;
+    batch_record_t **records = calloc(size, sizeof(batch_record_t *));
+    timestamp_t *timestamps = malloc(size * sizeof(timestamp_t));
+
+    if (!records || !timestamps)
+        log_err("no memory");
+    for (seq_t seq = ring->base; seq != ring->end; seq++) {
+        records[seq & (size - 1)] = ring->records[batch_ring_slot(ring, seq)];
+        timestamps[seq & (size - 1)] = ring->timestamps[batch_ring_slot(ring, seq)];
+    }
+    free(ring->records);
+    free(ring->timestamps);
+    ring->records = records;
+    ring->timestamps = timestamps;
+    ring->size = size;
+}
+
+
+// The caller holds the list lock of the origin for writing
+static inline void batch_ring_add(batch_ring_t *ring, batch_record_t *rec, seq_t seq)
+{
+    seq_t slot;
+
+    assert(seq == ring->end);
+    if (ring->end - ring->base == ring->size)
+        batch_ring_grow(ring);
+    slot = batch_ring_slot(ring, seq);
+    ring->records[slot] = rec;
+    ring->timestamps[slot] = *rec->timestamp;
+    ring->end++;
+}
+
+
+// The caller holds the list lock of the origin for writing
+static inline void batch_ring_del(batch_ring_t *ring, seq_t seq)
+{
+    ring->records[batch_ring_slot(ring, seq)] = NULL;
+    while (!batch_ring_empty(ring) && !ring->records[batch_ring_slot(ring, ring->base)])
+        ring->base++;
+}
+
+
+// Copies the timestamps from start to end into buf with at most two memcpys
+static inline void batch_ring_export(batch_ring_t *ring, timestamp_t *buf, seq_t start, seq_t end)
+{
+    seq_t count = end - start + 1;
+    seq_t slot = batch_ring_slot(ring, start);
+    seq_t n = ring->size - slot;
+
+    assert((start >= ring->base) && (end < ring->end));
+    if (n >= count)
+        memcpy(buf, &ring->timestamps[slot], count * sizeof(timestamp_t));
+    else {
+        memcpy(buf, &ring->timestamps[slot], n * sizeof(timestamp_t));
+        memcpy(&buf[n], ring->timestamps, (count - n) * sizeof(timestamp_t));
+    }
+}
+
 
 session_t get_session(int id)
 {
     session_t ret;
 
-    batch_rdlock();
-    if (id != node_id)
+    if (id != node_id) {
+        batch_session_lock(id);
         ret = batch_sessions[id];
-    else
+        batch_session_unlock(id);
+    } else {
+        batch_pack_lock();
         ret = batch_session;
-    batch_unlock();
+        batch_pack_unlock();
+    }
     return ret;
 }
 
 
 void set_session(int id, session_t session)
 {
-    batch_wrlock();
-    if (id != node_id)
+    if (id != node_id) {
+        batch_session_lock(id);
         batch_sessions[id] = session;
-    else
+        batch_session_unlock(id);
+    } else {
+        batch_pack_lock();
         batch_session = session;
-    batch_unlock();
+        batch_pack_unlock();
+    }
     log_func("session=%d (id=%d)", session, id);
 }
 
 
+#define batch_ring_exportable(rec, id) ((rec) && (rec)->visible[id] && is_empty(&(rec)->recycle))
+
 bool get_seq_end(int id, seq_t *seq)
 {
     bool match = false;
-    batch_list_t *pos;
-    batch_list_t *head = &batch_status.head[id];
+    batch_ring_t *ring = &batch_status.rings[id];
 
-    batch_rdlock();
-    for (pos = head->prev; pos != head; pos = pos->prev) {
-        batch_record_t *rec = list_entry(pos, batch_record_t, list[id]);
-
-        if (rec->visible[id] && is_empty(&rec->recycle)) {
-            *seq = rec->seq[id];
+    batch_list_rdlock(id);
+    for (seq_t i = ring->end; i != ring->base; i--) {
+        if (batch_ring_exportable(batch_ring_get(ring, i - 1), id)) {
+            *seq = i - 1;
             match = true;
             break;
         }
     }
-    batch_unlock();
+    batch_list_unlock(id);
     return match;
 }
 
@@ -175,108 +354,84 @@ bool get_seq_end(int id, seq_t *seq)
 bool get_seq_start(int id, seq_t *seq)
 {
     bool match = false;
-    batch_list_t *pos;
-    batch_list_t *head = &batch_status.head[id];
-
-    batch_rdlock();
-    for (pos = head->next; pos != head; pos = pos->next) {
-        batch_record_t *rec = list_entry(pos, batch_record_t, list[id]);
+    batch_ring_t *ring = &batch_status.rings[id];
 
-        if (rec->visible[id] && is_empty(&rec->recycle)) {
-            *seq = rec->seq[id];
+    batch_list_rdlock(id);
+    for (seq_t i = ring->base; i != ring->end; i++) {
+        if (batch_ring_exportable(batch_ring_get(ring, i), id)) {
+            *seq = i;
             match = true;
             break;
         }
     }
-    batch_unlock();
+    batch_list_unlock(id);
     return match;
 }
 
 
 void get_timestamps(int id, timestamp_t *timestamps, seq_t start, seq_t end)
 {
-    seq_t seq = 0;
-    batch_list_t *pos;
-    batch_record_t *rec = NULL;
-    timestamp_t *p = timestamps;
-    batch_list_t *head = &batch_status.head[id];
+    batch_ring_t *ring = &batch_status.rings[id];
 
     log_info("get timestamps ... (id=%d)", id);
-    batch_rdlock();
-    for (pos = head->next; pos != head; pos = pos->next) {
-        rec = list_entry(pos, batch_record_t, list[id]);
-        if (rec->visible[id] && is_empty(&rec->recycle)) {
-            if (!seq) {
-                seq = rec->seq[id];
-                assert(seq == start);
-            } else {
-                assert(seq + 1 == rec->seq[id]);
-                seq = rec->seq[id];
-            }
-            memcpy(p, rec->timestamp, sizeof(timestamp_t));
-            p++;
-        } else if (seq) {
-            assert(is_empty(&rec->recycle));
-            break;
-        }
-    }
-    batch_unlock();
+    batch_list_rdlock(id);
+    assert(batch_ring_exportable(batch_ring_get(ring, start), id));
+    assert(batch_ring_exportable(batch_ring_get(ring, end), id));
+    batch_ring_export(ring, timestamps, start, end);
+    batch_list_unlock(id);
     log_info("finished getting timestamps, start=%d, end=%d (id=%d)", start, end, id);
-    assert(rec && rec->seq[id] == end);
 }
 
 
 void add_timestamps(int id, timestamp_t *timestamps, int count, zmsg_t *msg)
 {
-    for (int i = 0; i < count; i++)
-        batch_add(id, &timestamps[i], msg);
-    ev_set(&batch_ev_checker);
-    ev_set(&batch_ev_cleaner);
+    assert((id >= 0) && (id < nr_nodes) && (id != node_id));
+    for (int i = 0; i < count; i += BATCH_BULK_MAX) {
+        int n = count - i;
+
+        batch_add_bulk(id, &timestamps[i], n < BATCH_BULK_MAX ? n : BATCH_BULK_MAX);
+    }
+    ev_set(&batch_ev_checker[id]);
+    ev_set(&batch_ev_cleaner[id]);
     show_header(id, &batch_timestamps.pkt_header);
     debug_slow_down_after_crash();
     zmsg_destroy(&msg);
 }
 
 
-inline void batch_wrlock()
-{
-    pthread_rwlock_wrlock(&batch_status.lock);
-}
-
-
-inline void batch_rdlock()
+inline void batch_pack_lock()
 {
-    pthread_rwlock_rdlock(&batch_status.lock);
+    batch_lock_wait(BATCH_LOCK_PACK, &batch_status.pack_lock, pthread_mutex_trylock, pthread_mutex_lock);
 }
 
 
-inline void batch_unlock()
+inline void batch_pack_unlock()
 {
-    pthread_rwlock_unlock(&batch_status.lock);
+    pthread_mutex_unlock(&batch_status.pack_lock);
 }
 
 
-inline void batch_recycle_lock()
+inline void batch_session_lock(int id)
 {
-    pthread_mutex_lock(&batch_status.recycle_lock);
+    batch_lock_wait(BATCH_LOCK_SESSION, &batch_status.session_locks[id], pthread_mutex_trylock, pthread_mutex_lock);
 }
 
 
-inline void batch_recycle_unlock()
+inline void batch_session_unlock(int id)
 {
-    pthread_mutex_unlock(&batch_status.recycle_lock);
+    pthread_mutex_unlock(&batch_status.session_locks[id]);
 }
 
 
 inline void batch_list_wrlock(int id)
 {
-    pthread_rwlock_wrlock(&batch_status.list_locks[id]);
+    batch_lock_wait(BATCH_LOCK_LIST, &batch_status.list_locks[id], pthread_rwlock_trywrlock, pthread_rwlock_wrlock);
 }
 
 
 inline void batch_list_rdlock(int id)
 {
-    pthread_rwlock_rdlock(&batch_status.list_locks[id]);
+    batch_lock_wait(BATCH_LOCK_LIST, &batch_status.list_locks[id], pthread_rwlock_tryrdlock, pthread_rwlock_rdlock);
 }
 
 
@@ -288,82 +443,154 @@ inline void batch_list_unlock(int id)
 
 static inline void batch_push(int id, batch_record_t *rec)
 {
-    batch_list_t *entry = &rec->list[id];
-    batch_list_t *head = &batch_status.head[id];
-
     track_enter();
     batch_list_wrlock(id);
     batch_progress[id]++;
     rec->seq[id] = batch_progress[id];
-    batch_list_add(entry, head);
+    batch_ring_add(&batch_status.rings[id], rec, rec->seq[id]);
     batch_record_set_receiver(rec, id);
+    batch_update_watermark(id);
     batch_list_unlock(id);
     track_exit();
 }
 
 
-inline batch_record_t *batch_lookup(batch_tree_t *tree, timestamp_t *timestamp)
+static inline bool batch_set_watermark(int id, seq_t seq)
 {
-    batch_node_t *node = NULL;
+    seq_t curr = batch_watermark[id];
 
-    if (!batch_node_lookup(tree, timestamp, &node))
-        return tree_entry(node, batch_record_t, node);
-    else
-        return NULL;
+    while (curr < seq) {
+        if (__sync_bool_compare_and_swap(&batch_watermark[id], curr, seq))
+            return true;
+        curr = batch_watermark[id];
+    }
+    return false;
+}
+
+
+// The watermark of a column is the highest seq that has been seen by a majority of nodes,
+// that is, the majority-th largest value of the column in batch_matrix.
+static inline bool batch_update_watermark(int id)
+{
+    int n = 0;
+    seq_t top[NODE_MAX];
+
+    for (int i = 0; i < nr_nodes; i++) {
+        int j;
+        seq_t seq = batch_matrix[i][id];
+
+        if ((n == majority) && (seq <= top[n - 1]))
+            continue;
+        if (n < majority)
+            n++;
+        for (j = n - 1; (j > 0) && (top[j - 1] < seq); j--)
+            top[j] = top[j - 1];
+        top[j] = seq;
+    }
+    return batch_set_watermark(id, top[majority - 1]);
 }
 
 
-bool batch_is_visible(int id, batch_record_t *record)
+static inline bool batch_is_visible(int id, batch_record_t *record, seq_t watermark)
 {
-    int cnt = 0;
     seq_t seq = record->seq[id];
 
-    if ((seq > 0) && batch_record_has_receiver(record, node_id)) {
-        for (int i = 0; i < nr_nodes; i++) {
-            if (seq <= batch_matrix[i][id]) {
-                cnt++;
-                if (cnt >= majority) {
-                    show_visible(id, record);
-                    return true;
-                }
-            }
-        }
+    if ((seq > 0) && (seq <= watermark) && batch_record_has_receiver(record, node_id)) {
+        show_visible(id, record);
+        return true;
     }
     return false;
 }
 
 
-int batch_node_compare(const void *t1, const void *t2)
+static inline uint64_t batch_now()
 {
-    assert(t1 && t2);
-    return timestamp_compare(t1, t2);
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
 
 
-zmsg_t *batch_pack()
+// The arrival rate is kept as an EWMA of arrivals per second, and the
+// target size of a batch is the number of arrivals expected in the budget.
+static inline void batch_update_target(uint64_t now)
+{
+    uint64_t rate = 0;
+    uint64_t intv = now - batch_status.arrival;
+
+    if (batch_status.arrival) {
+        rate = intv ? 1000000 / intv : 1000000;
+        batch_status.rate += ((int64_t)rate - (int64_t)batch_status.rate) >> BATCH_RATE_SHIFT;
+    }
+    batch_status.arrival = now;
+    batch_target = batch_status.rate * batch_latency_budget() / 1000000;
+    if (batch_target < BATCH_MIN)
+        batch_target = BATCH_MIN;
+    else if (batch_target > BATCH_MAX)
+        batch_target = BATCH_MAX;
+}
+
+
+// Encodes the pending timestamps together with the dep cells changed since the
+// last frame, and every BATCH_WIRE_REFRESH frames the whole matrix so that a
+// peer which missed a frame catches up. It is called with the pack lock held,
+// and the encoded frame is only touched by the sender afterwards.
+static inline size_t batch_encode()
+{
+    size_t size;
+    seq_t dep[NODE_MAX * NODE_MAX];
+    bool full = !(batch_status.frames % BATCH_WIRE_REFRESH) || (batch_status.sent_session != batch_session);
+
+    memcpy(dep, batch_pkt_header, batch_dep_size);
+    size = wire_pack(batch_status.wire, batch_session, dep, batch_status.sent, batch_nr_cells, full, batch_ts, batch_count);
+    memcpy(batch_status.sent, dep, batch_dep_size);
+    batch_status.sent_session = batch_session;
+    batch_status.frames++;
+    return size;
+}
+
+
+zmsg_t *batch_pack(timeout_t *wait)
 {
     zmsg_t *msg = NULL;
-    static seq_t progress[NODE_MAX * NODE_MAX] = {0};
 
-    batch_wrlock();
+    *wait = BATCH_SEND_INTV;
+    batch_pack_lock();
     assert(batch_count <= BATCH_NR_TIMESTAMPS);
     if (batch_count) {
-        size_t size = batch_pkt_header_size + batch_count * sizeof(timestamp_t);
-        zframe_t *frame = zframe_new(batch_pkt_header, size);
-
+        size_t size;
+        zframe_t *frame;
+        uint64_t age = batch_now() - batch_oldest;
+        uint64_t budget = batch_latency_budget();
+
+        if (batch_count >= batch_target)
+            batch_flushes[BATCH_FLUSH_SIZE]++;
+        else if (age >= budget)
+            batch_flushes[BATCH_FLUSH_DEADLINE]++;
+        else {
+            *wait = (budget - age) * 1000;
+            batch_pack_unlock();
+            return NULL;
+        }
+        size = batch_encode();
+        batch_status.packed += batch_count;
         batch_count = 0;
-        batch_unlock();
+        batch_pack_unlock();
+        frame = zframe_new(batch_status.wire, size);
         msg = zmsg_new();
         zmsg_prepend(msg, &frame);
         show_header(node_id, &batch_timestamps.pkt_header);
 #ifdef BATCH_DEP_MTX
         show_pack(batch_dep_matrix, true);
 #endif
-    } else if (memcmp(progress, batch_pkt_header, batch_dep_size)) {
-        zframe_t *frame = zframe_new(batch_pkt_header, batch_pkt_header_size);
+    } else if (memcmp(batch_status.sent, batch_pkt_header, batch_dep_size)) {
+        zframe_t *frame;
+        size_t size = batch_encode();
 
-        memcpy(progress, batch_pkt_header, batch_dep_size);
-        batch_unlock();
+        batch_flushes[BATCH_FLUSH_DEP]++;
+        batch_pack_unlock();
+        frame = zframe_new(batch_status.wire, size);
         msg = zmsg_new();
         zmsg_prepend(msg, &frame);
         show_header(node_id, &batch_timestamps.pkt_header);
@@ -371,106 +598,267 @@ zmsg_t *batch_pack()
         show_pack(batch_dep_matrix, false);
 #endif
     } else
-        batch_unlock();
+        batch_pack_unlock();
     return msg;
 }
 
 
+inline void batch_nack_lock()
+{
+    pthread_mutex_lock(&batch_status.nack_lock);
+}
+
+
+inline void batch_nack_unlock()
+{
+    pthread_mutex_unlock(&batch_status.nack_lock);
+}
+
+
+// Called with the nack lock held, the timestamps that do not fit are
+// dropped and will be asked for again.
+static inline void batch_nack_add(batch_nack_t *nack, timestamp_t *timestamps, int count)
+{
+    int n = BATCH_NACK_MAX - nack->count;
+
+    if (count > n)
+        count = n;
+    memcpy(&nack->timestamps[nack->count], timestamps, count * sizeof(timestamp_t));
+    nack->count += count;
+    batch_status.nack_pending = true;
+}
+
+
+static inline void batch_nack_take(batch_nack_t *nack, batch_nack_t *dst)
+{
+    batch_nack_lock();
+    dst->count = nack->count;
+    memcpy(dst->timestamps, nack->timestamps, nack->count * sizeof(timestamp_t));
+    nack->count = 0;
+    batch_nack_unlock();
+}
+
+
+static inline void batch_send_frame(char *buf, size_t size)
+{
+    zframe_t *frame = zframe_new(buf, size);
+    zmsg_t *msg = zmsg_new();
+
+    zmsg_prepend(msg, &frame);
+    send_message(msg);
+}
+
+
+// Sends the messages asked for by the peer id in one frame. A record found
+// in the index still holds its message, which is pinned while it is copied.
+static inline void batch_retransmit(int id, batch_nack_t *nack)
+{
+    int n = 0;
+    char *buf;
+    size_t size;
+    ref_msg_t *refs[BATCH_NACK_MAX];
+
+    for (int i = 0; i < nack->count; i++) {
+        index_entry_t *entry;
+        timestamp_t *timestamp = &nack->timestamps[i];
+
+        index_lock(timestamp);
+        entry = index_lookup(timestamp);
+        if (entry) {
+            batch_record_t *rec = batch_entry(entry);
+
+            if (rec->ref)
+                refs[n++] = ref_get(rec->ref);
+        }
+        index_unlock(timestamp);
+    }
+    if (!n)
+        return;
+    buf = malloc(wire_retx_size(refs, n));
+    if (!buf) {
+        log_err("no memory");
+        return;
+    }
+    size = wire_pack_retx(buf, id, refs, n);
+    batch_send_frame(buf, size);
+    free(buf);
+    for (int i = 0; i < n; i++)
+        ref_put(refs[i]);
+    batch_status.nacks[BATCH_NACK_RETX] += n;
+}
+
+
+// Runs on the sender, so requests and retransmissions never hold up the
+// threads that receive from the peers.
+static void batch_send_nacks()
+{
+    batch_nack_t nack;
+
+    if (!__atomic_exchange_n(&batch_status.nack_pending, false, __ATOMIC_ACQ_REL))
+        return;
+    for (int i = 0; i < nr_nodes; i++) {
+        if (i == node_id)
+            continue;
+        batch_nack_take(&batch_status.nack_out[i], &nack);
+        if (nack.count) {
+            size_t size = wire_pack_nack(batch_status.nack_wire, i, nack.timestamps, nack.count);
+
+            batch_send_frame(batch_status.nack_wire, size);
+            batch_status.nacks[BATCH_NACK_SENT] += nack.count;
+        }
+        batch_nack_take(&batch_status.nack_in[i], &nack);
+        if (nack.count)
+            batch_retransmit(i, &nack);
+    }
+}
+
+
 void *batch_sender(void *arg)
 {
     while (true) {
-        zmsg_t *msg = batch_pack();
+        timeout_t wait;
+        zmsg_t *msg;
 
+        batch_send_nacks();
+        msg = batch_pack(&wait);
         if (msg)
             send_message(msg);
         else
-            ev_wait(&batch_ev_send);
+            ev_timedwait(&batch_ev_send, wait);
     }
     return NULL;
 }
 
 
+// The checkers and the recycler are driven by events, a pass that leaves
+// work behind arms a one-shot kick in case the event it waits for is missed.
+void batch_kick(void *arg)
+{
+    __atomic_store_n(&batch_status.kicking, false, __ATOMIC_RELEASE);
+    batch_wake(batch_ev_checker);
+    ev_set(&batch_ev_recycle);
+}
+
+
+static inline void batch_arm_kick()
+{
+    if (!batch_status.kicking && __sync_bool_compare_and_swap(&batch_status.kicking, false, true))
+        timer_start(batch_status.kick, BATCH_KICK_INTV);
+}
+
+
 #ifdef FORWARD
-void *batch_forwarder(void *arg)
+static inline void batch_arm_nack()
 {
-    batch_list_t *head = &batch_status.head[node_id];
+    if (!batch_status.nacking && __sync_bool_compare_and_swap(&batch_status.nacking, false, true))
+        timer_start(batch_status.nack, BATCH_NACK_DELAY);
+}
 
-    while (true) {
-        batch_list_t *pos;
 
-        usleep(BATCH_FORWARD_INTV);
-        track_enter();
-        batch_list_rdlock(node_id);
-        list_for_each(pos, head) {
-            batch_record_t *rec = list_entry(pos, batch_record_t, list[node_id]);
-
-            switch (rec->timeout) {
-            case BATCH_TIMEOUT_INIT:
-                rec->timeout = BATCH_TIMEOUT_SET;
-                break;
-            case BATCH_TIMEOUT_SET:
-                if (!batch_receive_complete(rec)) {
-                    if (rec->msg) {
-                        show_timestamp(">> forward <<", -1, rec->timestamp);
-                        send_message(zmsg_dup(rec->msg));
-                    }
-                } else
-                    rec->timeout = BATCH_TIMEOUT_CLEAR;
-                break;
-            default:
-                break;
-            }
+// A checker stalls on a record that a majority has seen but whose message
+// has not arrived here. If it is still stalled after a delay, the messages
+// missing up to the watermark are asked from the origin, and again after
+// each delay until they arrive. A busy list is left for the next round.
+void batch_nack(void *arg)
+{
+    bool stalled = false;
+    timestamp_t timestamps[BATCH_NACK_MAX];
+
+    __atomic_store_n(&batch_status.nacking, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < nr_nodes; i++) {
+        int n = 0;
+        seq_t watermark = batch_watermark[i];
+        batch_ring_t *ring = &batch_status.rings[i];
+
+        if ((i == node_id) || !(available_nodes & node_mask[i]))
+            continue;
+        if (pthread_rwlock_tryrdlock(&batch_status.list_locks[i])) {
+            stalled = true;
+            continue;
+        }
+        for (seq_t seq = batch_prev[i] + 1; (seq < ring->end) && (seq <= watermark) && (n < BATCH_NACK_MAX); seq++) {
+            batch_record_t *rec = batch_ring_get(ring, seq);
+
+            if (rec && !batch_record_has_receiver(rec, node_id))
+                timestamps[n++] = *rec->timestamp;
+        }
+        batch_list_unlock(i);
+        if (n) {
+            batch_nack_lock();
+            batch_nack_add(&batch_status.nack_out[i], timestamps, n);
+            batch_nack_unlock();
+            stalled = true;
         }
-        batch_list_unlock(node_id);
-        track_exit();
+    }
+    if (stalled) {
+        ev_set(&batch_ev_send);
+        batch_arm_nack();
     }
 }
 #endif
 
 
-void batch_recycle(batch_record_t *rec)
+// Frees the records of a batch, taking each list lock once for the whole batch
+static inline void batch_recycle(batch_list_t *head)
 {
-    show_timestamp(">> recycle <<", -1, rec->timestamp);
+    batch_list_t *pos;
+    batch_list_t *next;
+
     for (int i = 0; i < nr_nodes; i++) {
-        batch_list_t *list = &rec->list[i];
-
-        if (is_valid(list)) {
-            batch_list_wrlock(i);
-            if (is_valid(list)) {
-                if (batch_prev[i] == list)
-                    batch_prev[i] = list->prev;
-                if (batch_tail[i] == list)
-                    batch_tail[i] = list->prev;
-                batch_list_del(list);
-            }
-            batch_list_unlock(i);
+        batch_list_wrlock(i);
+        list_for_each(pos, head) {
+            batch_record_t *rec = list_entry(pos, batch_record_t, recycle);
+
+            if (rec->seq[i])
+                batch_ring_del(&batch_status.rings[i], rec->seq[i]);
         }
+        batch_list_unlock(i);
+    }
+    for (pos = head->next, next = pos->next; pos != head; pos = next, next = next->next) {
+        batch_record_t *rec = list_entry(pos, batch_record_t, recycle);
+
+        show_timestamp(">> recycle <<", -1, rec->timestamp);
+        index_lock(rec->timestamp);
+        index_remove(&rec->entry);
+        index_unlock(rec->timestamp);
+        __sync_fetch_and_sub(&batch_bufsz, 1);
+        if (rec->entry.record)
+            record_free(rec->entry.record);
+        ref_put(rec->ref);
+        pool_free(POOL_BATCH, rec);
+        debug_quiet_after_recycle();
+        debug_crash_simu();
     }
-    batch_wrlock();
-    batch_node_remove(&batch_status.tree, &rec->node);
-    batch_bufsz--;
-    batch_unlock();
-    zmsg_destroy(&rec->msg);
-    free(rec);
-    debug_quiet_after_recycle();
-    debug_crash_simu();
 }
 
 
+// Releasing a record only marks it, and the recycler finds it in the
+// rings. The releasing thread counts its releases and wakes the recycler
+// in bulk by batch_retire().
+static __thread int batch_nr_released = 0;
+
+void batch_retire()
+{
+    if (batch_nr_released > 0) {
+        batch_nr_released = 0;
+        ev_set(&batch_ev_recycle);
+        batch_wake(batch_ev_cleaner);
+    }
+}
+
+
+// A record can be released by more than one thread (e.g., subscribers
+// finding it expired), so the first one claims its recycle link, which
+// points to itself until the recycler takes the record.
 void batch_do_release(batch_record_t *rec)
 {
     batch_list_t *list = &rec->recycle;
 
-    if (is_empty(list)) {
-        batch_recycle_lock();
-        if (is_empty(list)) {
-            show_timestamp(">> release <<", -1, rec->timestamp);
-            batch_list_add(list, &batch_status.recycle);
-            batch_recycle_counter++;
-            ev_set(&batch_ev_recycle);
-            ev_set(&batch_ev_cleaner);
-        }
-        batch_recycle_unlock();
+    if (is_empty(list) && __sync_bool_compare_and_swap(&list->next, NULL, list)) {
+        show_timestamp(">> release <<", -1, rec->timestamp);
+        batch_nr_released++;
+        if (batch_nr_released >= BATCH_RETIRE_MAX)
+            batch_retire();
     }
 }
 
@@ -483,60 +871,75 @@ static inline void batch_release(batch_record_t *rec)
 }
 
 
-void batch_remove(timestamp_t *timestamp)
+void batch_remove(index_entry_t *entry)
 {
-    batch_node_t *node = NULL;
+    batch_release(batch_entry(entry));
+}
 
-    if (!batch_node_lookup(&batch_status.tree, timestamp, &node)) {
-        batch_record_t *rec = tree_entry(node, batch_record_t, node);
 
-        batch_release(rec);
+// Returns the record of a timestamp which still expects a push from id, and
+// creates it if the timestamp is new and valid. A record whose push from id is
+// pending cannot be recycled, so it stays valid after the index is unlocked.
+static inline batch_record_t *batch_get(int id, timestamp_t *timestamp, zmsg_t *msg, bool valid, bool *duplicated)
+{
+    index_entry_t *entry;
+    batch_record_t *rec = NULL;
+
+    *duplicated = false;
+    index_lock(timestamp);
+    entry = index_lookup(timestamp);
+    if (entry) {
+        rec = batch_entry(entry);
+        if (batch_record_has_receiver(rec, id)) {
+            *duplicated = true;
+            rec = NULL;
+        }
+    } else if (valid) {
+        rec = pool_alloc(POOL_BATCH);
+        if (msg)
+            rec->timestamp = timestamp;
+        else {
+            rec->ts = *timestamp;
+            rec->timestamp = &rec->ts;
+        }
+        rec->entry.timestamp = rec->timestamp;
+        index_insert(&rec->entry);
     }
+    index_unlock(timestamp);
+    return rec;
 }
 
 
-static inline void batch_do_handle(zmsg_t *msg, timestamp_t *timestamp, batch_record_t *rec)
+static inline void batch_do_handle(zmsg_t *msg, timestamp_t *timestamp)
 {
+    bool duplicated;
     bool valid = timestamp_check(timestamp);
-    
+    batch_record_t *rec = batch_get(node_id, timestamp, msg, valid, &duplicated);
+
     track_enter();
-    if (!rec) {
-        if (valid) {
-            rec = calloc(1, sizeof(batch_record_t));
-            rec->msg = msg;
-            rec->timestamp = timestamp;
-            if (batch_node_insert(&batch_status.tree, rec->timestamp, &rec->node)) {
-                log_err("failed to handle");
-                assert(0);
-            }
-            batch_push(node_id, rec);
-        }
-    } else {
-        if (valid) {
-            if (!batch_record_has_receiver(rec, node_id)) {
-                rec->msg = msg;
-                batch_push(node_id, rec);
-            } else {
-                log_func("find a duplicated message");
-                show_timestamp("|--> >>duplicated<<", -1, timestamp);
-                valid = false;;
-            }
-        } else {
-            log_func("find an invalid message");
-            show_timestamp("|--> >>invalid<<", -1, timestamp);
-        }
-    }
-    if (valid) {
+    if (rec && valid) {
+        uint64_t now = batch_now();
+
+        rec->ref = ref_new(msg);
+        batch_push(node_id, rec);
+        batch_update_target(now);
+        if (!batch_count)
+            batch_oldest = now;
         batch_ts[batch_count] = *timestamp;
         batch_total++;
         batch_count++;
-        batch_bufsz++;
-        if (batch_count >= BATCH_MAX)
+        __sync_fetch_and_add(&batch_bufsz, 1);
+        if (batch_count >= batch_target)
             ev_set(&batch_ev_send);
         show_batch(-1, rec);
     } else {
-        log_func("find an expired message");
-        show_timestamp("|--> >>expired<<", -1, timestamp);
+        if (duplicated) {
+            log_func("find a duplicated message");
+            show_timestamp("|--> >>duplicated<<", -1, timestamp);
+        } else {
+            log_func("find an expired message");
+            show_timestamp("|--> >>expired<<", -1, timestamp);
+        }
         zmsg_destroy(&msg);
     }
     track_exit();
@@ -546,10 +949,9 @@ static inline void batch_do_handle(zmsg_t *msg, timestamp_t *timestamp, batch_re
 static inline void batch_handle(zmsg_t *msg)
 {
     timestamp_t *timestamp = get_timestamp(msg);
-    track_enter_call(batch_wrlock);
-    batch_record_t *rec = batch_lookup(&batch_status.tree, timestamp);
-    batch_do_handle(msg, timestamp, rec);
-    track_exit_call(batch_unlock);
+    track_enter_call(batch_pack_lock);
+    batch_do_handle(msg, timestamp);
+    track_exit_call(batch_pack_unlock);
 }
 
 
@@ -561,37 +963,54 @@ zmsg_t *batch(zmsg_t *msg)
 }
 
 
+// Handles the requests coalesced by a client under a single pack lock
+void batch_bulk(zmsg_t **msgs, int count)
+{
+    track_enter_call(batch_pack_lock);
+    for (int i = 0; i < count; i++)
+        batch_do_handle(msgs[i], get_timestamp(msgs[i]));
+    track_exit_call(batch_pack_unlock);
+    debug_slow_down_after_crash();
+}
+
+
 inline void batch_put(int id, batch_record_t *rec)
 {
     track_enter();
-    tracker_update(id, rec->timestamp, rec->msg);
+    tracker_update(id, rec->timestamp, batch_record_msg(rec));
     rec->visible[id] = true;
     track_exit();
 }
 
 
-void batch_check(int id)
+// batch_prev is the last seq of the origin that has been checked. Returns
+// true if the check stopped at a record whose message is missing here.
+bool batch_check(int id)
 {
-    batch_list_t *pos;
+    seq_t seq;
     batch_record_t *rec;
-    batch_list_t *head = &batch_status.head[id];
+    seq_t watermark = batch_watermark[id];
+    batch_ring_t *ring = &batch_status.rings[id];
 
+    if (watermark <= batch_checked[id])
+        return false;
     track_enter();
     batch_list_rdlock(id);
-    for (pos = batch_prev[id]->next; pos != head; pos = pos->next) {
-        rec = list_entry(pos, batch_record_t, list[id]);
+    for (seq = batch_prev[id] + 1; seq < ring->end; seq++) {
+        rec = batch_ring_get(ring, seq);
+        if (!rec)
+            continue;
         assert(!rec->visible[id]);
-        if (batch_is_visible(id, rec))
+        if (batch_is_visible(id, rec, watermark)) {
             batch_put(id, rec);
-        else {
-            batch_prev[id] = pos->prev;
+            batch_checked[id] = rec->seq[id];
+        } else
             break;
-        }
     }
-    if (pos == head)
-        batch_prev[id] = head->prev;
+    batch_prev[id] = seq - 1;
     batch_list_unlock(id);
     track_exit();
+    return (seq < ring->end) && (seq <= watermark);
 }
 
 
@@ -600,67 +1019,130 @@ void *batch_checker(void *arg)
     long id = (long)arg;
 
     while (true) {
-        ev_wait(&batch_ev_checker);
-        batch_check(id);
+        bool missing;
+
+        ev_wait(&batch_ev_checker[id]);
+        missing = batch_check(id);
+        if (batch_watermark[id] > batch_checked[id])
+            batch_arm_kick();
+#ifdef FORWARD
+        if (missing)
+            batch_arm_nack();
+#endif
         debug_slow_down_after_crash();
     }
     return NULL;
 }
 
 
-bool batch_can_clean(int id, batch_record_t *rec)
+// dst[i] = max(dst[i], src[i])
+static inline void batch_max_row(seq_t *dst, seq_t *src, int n)
 {
-    seq_t seq = rec->seq[id];
+    int i = 0;
+
+#ifdef __SSE4_1__
+    for (; i + 4 <= n; i += 4) {
+        __m128i a = _mm_loadu_si128((__m128i *)&dst[i]);
+        __m128i b = _mm_loadu_si128((__m128i *)&src[i]);
+
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_max_epu32(a, b));
+    }
+#endif
+    for (; i < n; i++)
+        if (dst[i] < src[i])
+            dst[i] = src[i];
+}
+
+
+// dst[i] = min(dst[i], src[i])
+static inline void batch_min_row(seq_t *dst, seq_t *src, int n)
+{
+    int i = 0;
+
+#ifdef __SSE4_1__
+    for (; i + 4 <= n; i += 4) {
+        __m128i a = _mm_loadu_si128((__m128i *)&dst[i]);
+        __m128i b = _mm_loadu_si128((__m128i *)&src[i]);
+
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_min_epu32(a, b));
+    }
+#endif
+    for (; i < n; i++)
+        if (dst[i] > src[i])
+            dst[i] = src[i];
+}
+
+
+// The clean watermark of a column is the smallest seq of the column over
+// the rows of alive nodes, so every record of the column up to it is clean.
+// The cleaners of the columns whose mark has moved are woken up.
+static inline void batch_update_clean()
+{
+    bool first = true;
+    seq_t mark[NODE_MAX];
 
-    assert(batch_progress[id] >= seq);
-#ifdef BATCH_DEP_MTX
     for (int i = 0; i < nr_nodes; i++) {
-        if (alive_node[i]) {
-            for (int j = 0; j < nr_nodes; j++) {
-                if (alive_node[j] && (batch_dep_matrix[i][j][id] < seq)) {
-                    log_func("cannot clean, dep[%d][%d][%d]=%d, seq=%d (id=%d)", i, j, id, batch_dep_matrix[i][j][id], seq, id);
-                    return false;
-                }
-            }
+        if (!alive_node[i])
+            continue;
+#ifdef BATCH_DEP_MTX
+        for (int j = 0; j < nr_nodes; j++) {
+            if (!alive_node[j])
+                continue;
+            if (first) {
+                memcpy(mark, batch_dep_matrix[i][j], batch_row_size);
+                first = false;
+            } else
+                batch_min_row(mark, batch_dep_matrix[i][j], nr_nodes);
         }
-    }
 #else
-    for (int i = 0; i < nr_nodes; i++) {
-        if (alive_node[i] && (batch_matrix[i][id] < seq)) {
-            log_func("cannot clean, dep[%d][%d]=%d, seq=%d", i, id, batch_matrix[i][id], seq);
-            return false;
+        if (first) {
+            memcpy(mark, batch_matrix[i], batch_row_size);
+            first = false;
+        } else
+            batch_min_row(mark, batch_matrix[i], nr_nodes);
+#endif
+    }
+    if (!first) {
+        for (int i = 0; i < nr_nodes; i++) {
+            if (batch_clean_mark[i] != mark[i]) {
+                batch_clean_mark[i] = mark[i];
+                ev_set(&batch_ev_cleaner[i]);
+            }
         }
     }
-#endif
-    return true;
 }
 
 
+// batch_tail is the last seq of the origin that has been cleaned
 void batch_clean(int id)
 {
-    batch_list_t *pos;
-    batch_list_t *tail;
+    seq_t seq;
     bool clean = false;
-    batch_record_t *rec;
-    batch_list_t *head = &batch_status.head[id];
+    bitmap_t mask = node_mask[id];
+    seq_t mark = batch_clean_mark[id];
+    batch_ring_t *ring = &batch_status.rings[id];
 
     batch_list_rdlock(id);
-    tail = batch_tail[id];
-    if (!list_empty(tail)) {
-        for (pos = tail->next; pos != head; pos = pos->next) {
-            bitmap_t mask = node_mask[id];
-
-            rec = list_entry(pos, batch_record_t, list[id]);
-            assert(!(rec->clean & mask));
-            if (batch_can_clean(id, rec)) {
-                clean = true;
-                rec->clean |= mask;
-                show_cleaner(">> clean <<", id, rec);
-            } else
-                break;
-        }
-        batch_tail[id] = pos->prev;
+    // the mark is refreshed on each merge of a peer matrix, and here
+    // only when the local rows may have moved it past the next record
+    if ((batch_tail[id] + 1 < ring->end) && (batch_tail[id] + 1 > mark)) {
+        batch_update_clean();
+        mark = batch_clean_mark[id];
     }
+    for (seq = batch_tail[id] + 1; (seq < ring->end) && (seq <= mark); seq++) {
+        batch_record_t *rec = batch_ring_get(ring, seq);
+
+        if (!rec)
+            continue;
+        assert(!(rec->clean & mask));
+        assert(batch_progress[id] >= seq);
+        clean = true;
+        __sync_fetch_and_or(&rec->clean, mask);
+        show_cleaner(">> clean <<", id, rec);
+    }
+    if ((seq < ring->end) && (seq > mark))
+        log_func("cannot clean, mark=%d, seq=%d (id=%d)", mark, seq, id);
+    batch_tail[id] = seq - 1;
     batch_list_unlock(id);
     if (clean)
         ev_set(&batch_ev_recycle);
@@ -672,128 +1154,138 @@ void *batch_cleaner(void *arg)
     long id = (long)arg;
 
     while (true) {
-        ev_wait(&batch_ev_cleaner);
+        ev_wait(&batch_ev_cleaner[id]);
         batch_clean(id);
     }
     return NULL;
 }
 
 
-void *batch_recycler(void *arg)
+// The reclaim watermark of an origin is the last seq it has cleaned, which
+// is bounded by both the clean watermark and the progress of the origin.
+// The prefix of the ring below it is walked from the base, collecting the
+// released records that every node has received and cleaned, and the walk
+// stops at the first record that cannot be freed yet. Returns true if that
+// record has been released, so it only waits for the other origins.
+static inline bool batch_reclaim(int id, batch_list_t *done)
 {
-    while (true) {
-        int cnt = 0;
-        batch_list_t *pos;
-        batch_list_t *tail;
-        batch_list_t *head = &batch_status.recycle;
+    seq_t seq;
+    bool blocked = false;
+    batch_ring_t *ring = &batch_status.rings[id];
 
-        ev_wait(&batch_ev_recycle);
-        batch_recycle_lock();
-        pos = head->next;
-        tail = head->prev;
-        batch_recycle_unlock();
-        if ((tail != head) && (pos != tail)) {
-            batch_list_t *i;
-
-            for (i = pos->next; i != tail; pos = i, i = i->next) {
-                batch_record_t *rec = list_entry(pos, batch_record_t, recycle);
-
-                if (batch_receive_complete(rec) && batch_clean_complete(rec)) {
-                    batch_list_del(pos);
-                    batch_recycle(rec);
-                    cnt++;
-                }
-            }
-        }
-        if (cnt) {
-            batch_recycle_lock();
-            assert(batch_recycle_counter >= cnt);
-            batch_recycle_counter -= cnt;
-            batch_recycle_unlock();
+    batch_list_rdlock(id);
+    for (seq = ring->base; (seq < ring->end) && (seq <= batch_tail[id]); seq++) {
+        batch_record_t *rec = batch_ring_get(ring, seq);
+
+        // a hole or a record taken by the walk of another origin
+        if (!rec || (!is_empty(&rec->recycle) && !batch_record_released(rec)))
+            continue;
+        if (!batch_record_released(rec) || !batch_receive_complete(rec) || !batch_clean_complete(rec)) {
+            blocked = !is_empty(&rec->recycle);
+            break;
         }
+        batch_list_add(&rec->recycle, done);
     }
+    batch_list_unlock(id);
+    return blocked;
 }
 
 
-static inline void batch_insert_timestamp(int id, timestamp_t *timestamp, zmsg_t *msg, batch_record_t *rec, bool valid)
+void *batch_recycler(void *arg)
 {
-    track_enter();
-    if (valid) {
-        rec = calloc(1, sizeof(batch_record_t));
-        rec->timestamp = &rec->ts,
-        rec->ts = *timestamp;
-        if (batch_node_insert(&batch_status.tree, rec->timestamp, &rec->node)) {
-            log_err("failed to insert");
-            assert(0);
-        }
-        batch_push(id, rec);
-        show_batch(id, rec);
-    } else {
-        log_func("find an expired message (released), id=%d", id);
-        show_timestamp("|--> >>expired<<", -1, timestamp);
-    }
-    track_exit();
-}
+    batch_list_t done;
 
+    while (true) {
+        bool blocked = false;
 
-static inline void batch_do_update_timestamp(int id, timestamp_t *timestamp, zmsg_t *msg, batch_record_t *rec)
-{
-    track_enter();
-    if (!batch_record_has_receiver(rec, id)) {
-        batch_push(id, rec);
-        show_batch(id, rec);
-    } else {
-        log_func("find a duplicated message, id=%d", id);
-        show_timestamp("|--> >>duplicated<<", -1, timestamp);
+        ev_wait(&batch_ev_recycle);
+        INIT_LIST_HEAD(&done);
+        for (int i = 0; i < nr_nodes; i++)
+            if ((available_nodes & node_mask[i]) && batch_reclaim(i, &done))
+                blocked = true;
+        if (!list_empty(&done))
+            batch_recycle(&done);
+        if (blocked)
+            batch_arm_kick();
     }
-    track_exit();
 }
 
 
-static inline void batch_update_timestamp(int id, timestamp_t *timestamp, zmsg_t *msg, batch_record_t *rec, bool valid)
+// Merges a run of timestamps announced by a peer. The records are looked up
+// first, and then they are appended to the list of the peer under a single
+// list lock, with the watermark of the peer updated once for the whole run.
+static inline void batch_add_bulk(int id, timestamp_t *timestamps, int count)
 {
+    int n = 0;
+    bool valid[BATCH_BULK_MAX];
+    batch_ring_t *ring = &batch_status.rings[id];
+    batch_record_t *records[BATCH_BULK_MAX];
+
     track_enter();
-    if (valid)
-        batch_do_update_timestamp(id, timestamp, msg, rec);
-    else {
-        log_func("find an expired message, id=%d", id);
-        show_timestamp("|--> >>expired<<", -1, timestamp);
-        batch_push(id, rec);
-        batch_do_release(rec);
+    for (int i = 0; i < count; i++) {
+        bool duplicated;
+        timestamp_t *timestamp = &timestamps[i];
+
+        if (i + BATCH_PREFETCH_DIST < count)
+            index_prefetch(&timestamps[i + BATCH_PREFETCH_DIST]);
+        valid[n] = timestamp_check(timestamp);
+        records[n] = batch_get(id, timestamp, NULL, valid[n], &duplicated);
+        if (records[n])
+            n++;
+        else if (duplicated) {
+            log_func("find a duplicated message, id=%d", id);
+            show_timestamp("|--> >>duplicated<<", -1, timestamp);
+        } else {
+            log_func("find an expired message (released), id=%d", id);
+            show_timestamp("|--> >>expired<<", -1, timestamp);
+        }
     }
-    track_exit();
-}
-
+    if (!n)
+        goto out;
+    batch_list_wrlock(id);
+    for (int i = 0; i < n; i++) {
+        batch_record_t *rec = records[i];
 
-static inline void batch_add(int id, timestamp_t *timestamp, zmsg_t *msg)
-{
-    assert((id >= 0) && (id < nr_nodes) && (id != node_id) && timestamp);
-    track_enter_call(batch_wrlock);
-    bool valid = timestamp_check(timestamp);
-    batch_record_t *rec = batch_lookup(&batch_status.tree, timestamp);
+        if (batch_record_has_receiver(rec, id)) {
+            records[i] = NULL;
+            continue;
+        }
+        batch_progress[id]++;
+        rec->seq[id] = batch_progress[id];
+        batch_ring_add(ring, rec, rec->seq[id]);
+        batch_record_set_receiver(rec, id);
+    }
+    batch_update_watermark(id);
+    batch_list_unlock(id);
+    for (int i = 0; i < n; i++) {
+        batch_record_t *rec = records[i];
 
-    if (!rec)
-        batch_insert_timestamp(id, timestamp, msg, rec, valid);
-    else
-        batch_update_timestamp(id, timestamp, msg, rec, valid);
-    track_exit_call(batch_unlock);
+        if (!rec)
+            continue;
+        show_batch(id, rec);
+        if (!valid[i]) {
+            log_func("find an expired message, id=%d", id);
+            show_timestamp("|--> >>expired<<", -1, rec->timestamp);
+            batch_do_release(rec);
+        }
+    }
+    batch_retire();
+out:
+    track_exit();
 }
 
 
-inline bool batch_unpack(int id, void *buf, timestamp_t **first, int *count, seq_t **dep)
+// Frames of a peer are decoded into its own buffers, and rx_dep keeps the
+// latest matrix of the peer across the frames that only carry changed cells.
+inline bool batch_unpack(int id, zframe_t *frame, timestamp_t **first, int *count, seq_t **dep)
 {
-    batch_pkt_header_t *head = (batch_pkt_header_t *)((char *)buf - batch_pkt_header_off);
-    session_t session = *(&head->session);
-
-    if (session == batch_sessions[id]) {
-        *dep = (seq_t *)buf;
-        *count = *(&head->count);
-        *first = (timestamp_t *)&head[1];
-        return true;
-    } else {
-        log_debug("dropped, session=%d (current=%d)", session, batch_sessions[id]);
+    *count = BATCH_NR_TIMESTAMPS;
+    if (wire_unpack((char *)zframe_data(frame), zframe_size(frame), batch_sessions[id],
+                    batch_status.rx_dep[id], batch_nr_cells, batch_status.rx[id], count))
         return false;
-    }
+    *dep = batch_status.rx_dep[id];
+    *first = batch_status.rx[id];
+    return true;
 }
 
 
@@ -806,9 +1298,7 @@ void batch_update_dep(int id, seq_t *dep)
 #ifdef BATCH_FAST_UPDATE
         memcpy(batch_dep_matrix[id][i], ptr, batch_row_size);
 #else
-        for (int j = 0; j < nr_nodes; j++)
-            if (batch_dep_matrix[id][i][j] < ptr[j])
-                batch_dep_matrix[id][i][j] = ptr[j];
+        batch_max_row(batch_dep_matrix[id][i], ptr, nr_nodes);
 #endif
         ptr += nr_nodes;
     }
@@ -817,11 +1307,43 @@ void batch_update_dep(int id, seq_t *dep)
 #ifdef BATCH_FAST_UPDATE
     memcpy(batch_matrix[id], dep, batch_row_size);
 #else
-    for (int i = 0; i < nr_nodes; i++)
-        if (batch_matrix[id][i] < dep[i])
-            batch_matrix[id][i] = dep[i];
+    batch_max_row(batch_matrix[id], dep, nr_nodes);
 #endif
 #endif
+    for (int i = 0; i < nr_nodes; i++)
+        if (batch_update_watermark(i))
+            ev_set(&batch_ev_checker[i]);
+    batch_update_clean();
+}
+
+
+// Requests from the peer id are only queued here, the sender serves them
+static inline void batch_recv_nack(int id, char *buf, size_t size)
+{
+    int count = BATCH_NACK_MAX;
+    timestamp_t timestamps[BATCH_NACK_MAX];
+
+    if (wire_unpack_nack(buf, size, timestamps, &count))
+        return;
+    batch_nack_lock();
+    batch_nack_add(&batch_status.nack_in[id], timestamps, count);
+    batch_nack_unlock();
+    __sync_fetch_and_add(&batch_status.nacks[BATCH_NACK_RECEIVED], count);
+    ev_set(&batch_ev_send);
+}
+
+
+// Retransmitted messages are handled as if they had been forwarded
+static inline void batch_recv_retx(int id, char *buf, size_t size)
+{
+    int count = BATCH_NACK_MAX;
+    zmsg_t *msgs[BATCH_NACK_MAX];
+
+    if (wire_unpack_retx(buf, size, msgs, &count))
+        return;
+    log_func("retransmitted, count=%d (id=%d)", count, id);
+    for (int i = 0; i < count; i++)
+        batch(msgs[i]);
 }
 
 
@@ -832,10 +1354,25 @@ void batch_update(int id, zmsg_t *msg)
     timestamp_t *timestamps = NULL;
     zframe_t *frame = zmsg_first(msg);
     char *buf = (char *)zframe_data(frame);
+    size_t size = zframe_size(frame);
 
-    if (batch_unpack(id, buf, &timestamps, &count, &dep)) {
-        batch_update_dep(id, dep);
-        add_timestamps(id, timestamps, count, msg);
+    switch (wire_kind(buf, size)) {
+    case WIRE_NACK:
+        if (wire_target(buf, size) == node_id)
+            batch_recv_nack(id, buf, size);
+        zmsg_destroy(&msg);
+        break;
+    case WIRE_RETX:
+        if (wire_target(buf, size) == node_id)
+            batch_recv_retx(id, buf, size);
+        zmsg_destroy(&msg);
+        break;
+    default:
+        if (batch_unpack(id, frame, &timestamps, &count, &dep)) {
+            batch_update_dep(id, dep);
+            add_timestamps(id, timestamps, count, msg);
+        } else
+            zmsg_destroy(&msg);
     }
 }
 
@@ -878,20 +1415,6 @@ void batch_create_cleaners()
 }
 
 
-#ifdef FORWARD
-void batch_create_forwarder()
-{
-    pthread_t thread;
-    pthread_attr_t attr;
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-    pthread_create(&thread, &attr, batch_forwarder, NULL);
-}
-#endif
-
-
 void batch_create_checkers()
 {
     for (long i = 0; i < nr_nodes; i++) {
@@ -920,10 +1443,11 @@ void batch_init()
     off += NODE_MAX * NODE_MAX - nr_nodes;
 #endif
     for (int i = 0; i < nr_nodes; i++) {
-        INIT_LIST_HEAD(&batch_status.head[i]);
-        batch_prev[i] = &batch_status.head[i];
-        batch_tail[i] = &batch_status.head[i];
+        batch_ring_init(&batch_status.rings[i]);
+        batch_prev[i] = 0;
+        batch_tail[i] = 0;
         pthread_rwlock_init(&batch_status.list_locks[i], NULL);
+        pthread_mutex_init(&batch_status.session_locks[i], NULL);
 #ifdef BATCH_DEP_MTX
         for (int j = 0; j < nr_nodes; j++) {
             if ((j != i) && (i != node_id))
@@ -940,16 +1464,15 @@ void batch_init()
             batch_matrix[i] = &batch_dep[off];
 #endif
     }
-    if (batch_tree_create(&batch_status.tree, batch_node_compare))
-        log_err("failed to create");
+    index_init();
+    pool_create(POOL_BATCH, sizeof(batch_record_t));
     batch_total = 0;
     batch_bufsz = 0;
     batch_count = 0;
     batch_session = 0;
-    batch_recycle_counter = 0;
+    batch_target = BATCH_MIN;
     batch_pkt_header_off = off * sizeof(seq_t);
     batch_pkt_header = (char *)&batch_timestamps + batch_pkt_header_off;
-    batch_pkt_header_size = sizeof(batch_pkt_header_t) - batch_pkt_header_off;
     assert(batch_pkt_header == (char *)&batch_dep[off]);
 #ifdef BATCH_DEP_MTX
     batch_progress = batch_dep_matrix[node_id][node_id];
@@ -958,21 +1481,60 @@ void batch_init()
     memset(batch_status.dep, 0, sz);
 #endif
     ev_init(&batch_ev_send, BATCH_SEND_INTV);
-    ev_init(&batch_ev_cleaner, BATCH_CLEAN_INTV);
-    ev_init(&batch_ev_checker, BATCH_CHECK_INTV);
-    ev_init(&batch_ev_recycle, BATCH_RECYCLE_INTV);
+    for (int i = 0; i < nr_nodes; i++) {
+        ev_init(&batch_ev_cleaner[i], BATCH_CLEAN_INTV);
+        ev_init(&batch_ev_checker[i], EV_NOTIMEOUT);
+    }
+    ev_init(&batch_ev_recycle, EV_NOTIMEOUT);
+    batch_status.kicking = false;
+    batch_status.kick = timer_new(batch_kick, NULL, 0);
+    batch_status.nacking = false;
+    batch_status.nack_pending = false;
+#ifdef FORWARD
+    batch_status.nack = timer_new(batch_nack, NULL, 0);
+#endif
+    memset(batch_status.nacks, 0, sizeof(batch_status.nacks));
+    memset(batch_status.nack_in, 0, sizeof(batch_status.nack_in));
+    memset(batch_status.nack_out, 0, sizeof(batch_status.nack_out));
+    pthread_mutex_init(&batch_status.nack_lock, NULL);
     memset(batch_dep, 0, sz);
     get_time(batch_status.time);
-    INIT_LIST_HEAD(&batch_status.recycle);
-    pthread_rwlock_init(&batch_status.lock, NULL);
-    pthread_mutex_init(&batch_status.recycle_lock, NULL);
+    memset(batch_clean_mark, 0, sizeof(batch_clean_mark));
+    memset(batch_status.waits, 0, sizeof(batch_status.waits));
+    memset(batch_flushes, 0, sizeof(batch_flushes));
+    pthread_mutex_init(&batch_status.pack_lock, NULL);
     batch_create_recycler();
     batch_create_checkers();
     batch_create_cleaners();
     batch_create_sender();
-#ifdef FORWARD
-    batch_create_forwarder();
-#endif
+}
+
+
+void batch_show_stat()
+{
+    uint64_t flushes = 0;
+
+    for (int i = 0; i < NR_BATCH_FLUSHES; i++)
+        flushes += batch_flushes[i];
+    show_flush(batch_target, batch_status.rate, flushes ? batch_status.packed / flushes : 0,
+               batch_flushes[BATCH_FLUSH_SIZE], batch_flushes[BATCH_FLUSH_DEADLINE], batch_flushes[BATCH_FLUSH_DEP]);
+
+    show_lock("pack", batch_status.waits[BATCH_LOCK_PACK]);
+    show_lock("list", batch_status.waits[BATCH_LOCK_LIST]);
+    show_lock("session", batch_status.waits[BATCH_LOCK_SESSION]);
+    show_lock("index", index_get_waits());
+    show_nack(batch_status.nacks[BATCH_NACK_SENT], batch_status.nacks[BATCH_NACK_RECEIVED], batch_status.nacks[BATCH_NACK_RETX]);
+
+    show_ev("send", &batch_ev_send);
+    for (int i = 0; i < nr_nodes; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "checker%d", i);
+        show_ev(name, &batch_ev_checker[i]);
+        snprintf(name, sizeof(name), "cleaner%d", i);
+        show_ev(name, &batch_ev_cleaner[i]);
+    }
+    show_ev("recycle", &batch_ev_recycle);
 }
 
 
@@ -981,7 +1543,7 @@ bool batch_drain()
     for (int i = 0; i < nr_nodes; i++) {
         if (available_nodes & node_mask[i]) {
             batch_list_rdlock(i);
-            bool empty = list_empty(&batch_status.head[i]);
+            bool empty = batch_ring_empty(&batch_status.rings[i]);
             batch_list_unlock(i);
             if (!empty)
                 return false;
@@ -2,15 +2,17 @@
 #define _BATCH_H
 
 #include "util.h"
+#include "index.h"
 
 #define is_batched(msg) (1 == zmsg_size(msg))
 
 void batch_init();
 bool batch_drain();
-void batch_wrlock();
-void batch_unlock();
+void batch_show_stat();
 zmsg_t *batch(zmsg_t *msg);
+void batch_bulk(zmsg_t **msgs, int count);
 void batch_update(int id, zmsg_t *msg);
-void batch_remove(timestamp_t *timestamp);
+void batch_remove(index_entry_t *entry);
+void batch_retire();
 
 #endif
@@ -1,4 +1,5 @@
 #include <tbc.h>
+#include "ev.h"
 #include "generator.h"
 #include "collector.h"
 #include "publisher.h"
@@ -32,6 +33,8 @@ typedef struct {
 } coll_req_t;
 
 struct {
+    ev_t ev_fault;
+    bitmap_t faults;
     bitmap_t suspect;
     coll_state_t state;
     seq_t seq[NODE_MAX];
@@ -361,16 +364,34 @@ void collector_do_fault()
 }
 
 
+// Called by the heartbeats on the timer, which must not block, so the
+// faults are only recorded here and suspected by the fault handler
 void collector_fault(int id)
 {
-    collector_lock();
-    if (!(collector_status.suspect & node_mask[id])) {
-        collector_status.suspect |= node_mask[id];
-        if (collector_status.state != STATE_IDLE)
-            collector_reset();
-        collector_do_fault();
+    __atomic_fetch_or(&collector_status.faults, node_mask[id], __ATOMIC_RELEASE);
+    ev_set(&collector_status.ev_fault);
+}
+
+
+void *collector_handle_fault(void *ptr)
+{
+    while (true) {
+        bitmap_t faults;
+
+        ev_wait(&collector_status.ev_fault);
+        faults = __atomic_exchange_n(&collector_status.faults, 0, __ATOMIC_ACQUIRE);
+        if (!faults)
+            continue;
+        collector_lock();
+        if (faults & ~collector_status.suspect) {
+            collector_status.suspect |= faults;
+            if (collector_status.state != STATE_IDLE)
+                collector_reset();
+            collector_do_fault();
+        }
+        collector_unlock();
     }
-    collector_unlock();
+    return NULL;
 }
 
 
@@ -493,10 +514,12 @@ out:
 
 void collector_init()
 {
+    collector_status.faults = 0;
     collector_status.suspect = 0;
     collector_status.recoverable = 0;
     collector_status.state = STATE_IDLE;
     pthread_mutex_init(&collector_status.lock, NULL);
+    ev_init(&collector_status.ev_fault, EV_NOTIMEOUT);
     for (int i = 0; i < NR_STATES; i++)
         for (int j = 0; j < NODE_MAX; j++)
             collector_status.members[i][j] = 0;
@@ -534,5 +557,11 @@ void collector_create()
     pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
     pthread_create(&thread, &attr, collector_handle, NULL);
     pthread_attr_destroy(&attr);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, collector_handle_fault, NULL);
+    pthread_attr_destroy(&attr);
     collector_connect();
 }
@@ -0,0 +1,269 @@
+#include "completion.h"
+
+#define completion_lock() pthread_mutex_lock(&completion_status.lock)
+#define completion_unlock() pthread_mutex_unlock(&completion_status.lock)
+#define completion_slot(hid) hid_hash(hid, COMPLETION_CLIENTS_BITS)
+#define completion_is_stale(client, now) ((int32_t)((now) - (client)->touch) > COMPLETION_TTL)
+#define completion_history(client, seq) (&(client)->history[(seq) & (COMPLETION_HISTORY - 1)])
+
+// The latest COMPLETION_HISTORY completions of a client, up to seq. The
+// history of a slot is kept once allocated, and touch is the time of the
+// latest request of the client.
+typedef struct {
+    hid_t hid;
+    seq_t seq;
+    bool used;
+    timestamp_sec_t touch;
+    completion_t *history;
+} completion_client_t;
+
+// The lock is taken by the deliverer and the responder
+struct {
+    void *socket;
+    void *context;
+    timestamp_sec_t now; // the latest time of the delivered requests
+    pthread_mutex_t lock;
+    completion_client_t clients[COMPLETION_CLIENTS];
+    char buf[COMPLETION_FRAME_SIZE];
+} completion_status;
+
+static completion_client_t *completion_lookup(hid_t hid)
+{
+    seq_t slot = completion_slot(hid);
+
+    for (int i = 0; i < COMPLETION_CLIENTS; i++) {
+        completion_client_t *client = &completion_status.clients[(slot + i) & (COMPLETION_CLIENTS - 1)];
+
+        if (!client->history)
+            break;
+        else if (client->used && (client->hid == hid))
+            return client;
+    }
+    return NULL;
+}
+
+
+// A client idle for COMPLETION_TTL gives its slot to a new one. The time is
+// that of the delivered request, so that every node evicts the same clients
+// at the same point of the delivery order. Returns NULL if every slot is
+// taken by an active client.
+static completion_client_t *completion_add(hid_t hid, timestamp_sec_t now)
+{
+    completion_client_t *client = NULL;
+    seq_t slot = completion_slot(hid);
+
+    for (int i = 0; i < COMPLETION_CLIENTS; i++) {
+        completion_client_t *curr = &completion_status.clients[(slot + i) & (COMPLETION_CLIENTS - 1)];
+
+        if (!curr->history) {
+            curr->history = malloc(COMPLETION_HISTORY * sizeof(completion_t));
+            if (!curr->history) {
+                log_err("no memory");
+                return NULL;
+            }
+            client = curr;
+            break;
+        } else if (!curr->used || completion_is_stale(curr, now)) {
+            client = curr;
+            break;
+        }
+    }
+    if (client) {
+        client->hid = hid;
+        client->seq = 0;
+        client->used = true;
+        client->touch = now;
+    }
+    return client;
+}
+
+
+// The completer of a client moves on to the next node once it fails
+static inline bool completion_is_completer(hid_t hid)
+{
+    for (int i = 0; i < nr_nodes; i++) {
+        int id = (get_completer(hid) + i) % nr_nodes;
+
+        if (available_nodes & node_mask[id])
+            return id == node_id;
+    }
+    return false;
+}
+
+
+// Serves the resend requests of clients, with up to COMPLETION_MAX
+// completions from the requested seq (or from the oldest one kept).
+void *completion_responder(void *arg)
+{
+    void *socket;
+    char addr[ADDR_SIZE];
+    char buf[COMPLETION_FRAME_SIZE];
+    completion_hdr_t *rep = (completion_hdr_t *)buf;
+    completion_t *completions = (completion_t *)(buf + sizeof(completion_hdr_t));
+
+    socket = zmq_socket(completion_status.context, ZMQ_REP);
+    tcpaddr(addr, inet_ntoa(get_addr()), resend_port);
+    if (zmq_bind(socket, addr)) {
+        log_err("failed to bind %s", addr);
+        return NULL;
+    }
+    while (true) {
+        int n = 0;
+        seq_t next;
+        completion_hdr_t req;
+        completion_client_t *client;
+        int ret = zmq_recv(socket, &req, sizeof(completion_hdr_t), 0);
+
+        if (ret < 0)
+            continue;
+        if (ret != sizeof(completion_hdr_t)) {
+            memset(rep, 0, sizeof(completion_hdr_t));
+            zmq_send(socket, buf, sizeof(completion_hdr_t), 0);
+            continue;
+        }
+        completion_lock();
+        client = completion_lookup(req.hid);
+        next = client ? client->seq + 1 : 1;
+        rep->hid = req.hid;
+        if (COMPLETION_SYNC == req.seq) {
+            rep->seq = next;
+            zmq_send(completion_status.socket, rep, sizeof(completion_hdr_t), 0);
+        } else {
+            seq_t oldest = next > COMPLETION_HISTORY ? next - COMPLETION_HISTORY : 1;
+
+            if (req.seq >= next)
+                rep->seq = next;
+            else
+                rep->seq = req.seq < oldest ? oldest : req.seq;
+            for (seq_t seq = rep->seq; (seq < next) && (n < COMPLETION_MAX); seq++)
+                completions[n++] = *completion_history(client, seq);
+        }
+        completion_unlock();
+        zmq_send(socket, buf, sizeof(completion_hdr_t) + n * sizeof(completion_t), 0);
+    }
+    return NULL;
+}
+
+
+void completion_init()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    char addr[ADDR_SIZE];
+#ifdef HIGH_WATER_MARK
+    int hwm = HIGH_WATER_MARK;
+#endif
+    completion_status.socket = NULL;
+    if (-1 == completion_port) {
+        log_func("no completion port");
+        return;
+    }
+    memset(completion_status.clients, 0, sizeof(completion_status.clients));
+    pthread_mutex_init(&completion_status.lock, NULL);
+    completion_status.context = zmq_ctx_new();
+    completion_status.socket = zmq_socket(completion_status.context, ZMQ_PUB);
+#ifdef HIGH_WATER_MARK
+    zmq_setsockopt(completion_status.socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+#endif
+    tcpaddr(addr, inet_ntoa(get_addr()), completion_port);
+    if (zmq_bind(completion_status.socket, addr)) {
+        log_err("failed to bind %s", addr);
+        zmq_close(completion_status.socket);
+        zmq_ctx_destroy(completion_status.context);
+        completion_status.socket = NULL;
+        return;
+    }
+    if (-1 == resend_port) {
+        log_func("no resend port");
+        return;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, completion_responder, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+
+// Returns the number of clients with requests delivered within the last
+// period seconds
+int completion_count_clients(int period)
+{
+    int count = 0;
+
+    if (!completion_status.socket)
+        return 0;
+    completion_lock();
+    for (int i = 0; i < COMPLETION_CLIENTS; i++) {
+        completion_client_t *client = &completion_status.clients[i];
+
+        if (client->used && ((int32_t)(completion_status.now - client->touch) <= period))
+            count++;
+    }
+    completion_unlock();
+    return count;
+}
+
+
+void completion_publish(void *buf, size_t size)
+{
+    if (completion_status.socket) {
+        completion_lock();
+        zmq_send(completion_status.socket, buf, size, 0);
+        completion_unlock();
+    }
+}
+
+
+static inline void completion_send(int count)
+{
+    zmq_send(completion_status.socket, completion_status.buf, sizeof(completion_hdr_t) + count * sizeof(completion_t), 0);
+}
+
+
+// Called by the deliverer after the requests have been handled. Every node
+// counts the completions of every client, and the completer of a client
+// also sends them, with a run of the same client in one frame. A client
+// that finds no slot gets no completions.
+void complete(request_t *requests, int count)
+{
+    int n = 0;
+    completion_client_t *client = NULL;
+    completion_hdr_t *hdr = (completion_hdr_t *)completion_status.buf;
+    completion_t *completions = (completion_t *)(completion_status.buf + sizeof(completion_hdr_t));
+
+    if (!completion_status.socket)
+        return;
+    completion_lock();
+    for (int i = 0; i < count; i++) {
+        completion_t *completion;
+        timestamp_t *timestamp = requests[i].timestamp;
+
+        if (n && ((timestamp->hid != hdr->hid) || (n == COMPLETION_MAX))) {
+            completion_send(n);
+            n = 0;
+        }
+        if (!client || (client->hid != timestamp->hid)) {
+            client = completion_lookup(timestamp->hid);
+            if (!client && !(client = completion_add(timestamp->hid, timestamp->sec)))
+                continue;
+        }
+        client->touch = timestamp->sec;
+        if ((int32_t)(timestamp->sec - completion_status.now) > 0)
+            completion_status.now = timestamp->sec;
+        client->seq++;
+        completion = completion_history(client, client->seq);
+        completion->sec = timestamp->sec;
+        completion->usec = timestamp->usec;
+        if (!completion_is_completer(client->hid))
+            continue;
+        if (!n) {
+            hdr->hid = client->hid;
+            hdr->seq = client->seq;
+        }
+        completions[n++] = *completion;
+    }
+    if (n)
+        completion_send(n);
+    completion_unlock();
+}
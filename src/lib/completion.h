@@ -0,0 +1,45 @@
+#ifndef _COMPLETION_H
+#define _COMPLETION_H
+
+#include "util.h"
+
+#define COMPLETION_MAX     256  // completions per frame
+#define COMPLETION_HISTORY 4096 // completions kept per client, must be a power of 2
+#define COMPLETION_CLIENTS_BITS 10
+#define COMPLETION_CLIENTS (1 << COMPLETION_CLIENTS_BITS) // clients
+#define COMPLETION_TTL     3600 // sec, after which an idle client is forgotten
+
+#define COMPLETION_FRAME_SIZE (sizeof(completion_hdr_t) + COMPLETION_MAX * sizeof(completion_t))
+
+// The node preferred to notify a client of its delivered requests
+#define get_completer(hid) ((hid) % nr_nodes)
+
+/*
+ * A completion frame is a header followed by the completions of a client's
+ * requests in delivery order, so that a client subscribes to its hid. The
+ * seq of a completion counts the delivered requests of the client, which
+ * every node counts alike, so a client detects a lost frame from a gap and
+ * asks any node to resend from a seq on the resend port. The completer of
+ * a client is the first available node from get_completer(hid). A client
+ * forgotten after COMPLETION_TTL starts again from seq 1.
+ */
+typedef struct {
+    hid_t hid;
+    seq_t seq; // the seq of the first completion
+} completion_hdr_t;
+
+typedef struct {
+    timestamp_sec_t sec;
+    timestamp_usec_t usec;
+} completion_t;
+
+// A resend request from this seq returns the next seq and publishes an empty
+// frame to the client, which then knows that its subscription is in place.
+#define COMPLETION_SYNC ((seq_t)-1)
+
+void completion_init();
+void complete(request_t *requests, int count);
+void completion_publish(void *buf, size_t size);
+int completion_count_clients(int period);
+
+#endif
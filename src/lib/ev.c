@@ -1,27 +1,179 @@
 #include "ev.h"
 #include "log.h"
 
-int ev_init(ev_t *ev, timeout_t timeout)
+#define ev_has_timeout(timeout) (((timeout) > 0) && ((timeout) != (timeout_t)EV_NOTIMEOUT))
+#define ev_stat_inc(ev, name, n) __atomic_add_fetch(&(ev)->stat.name, n, __ATOMIC_RELAXED)
+
+void ev_get_stat(ev_t *ev, ev_stat_t *stat)
 {
-    if (timeout > 0) {
-        pthread_condattr_t attr;
-        pthread_condattr_init(&attr);
+    stat->wakeups = __atomic_load_n(&ev->stat.wakeups, __ATOMIC_RELAXED);
+    stat->spurious = __atomic_load_n(&ev->stat.spurious, __ATOMIC_RELAXED);
+    stat->timeouts = __atomic_load_n(&ev->stat.timeouts, __ATOMIC_RELAXED);
+    stat->spins = __atomic_load_n(&ev->stat.spins, __ATOMIC_RELAXED);
+    stat->latency = __atomic_load_n(&ev->stat.latency, __ATOMIC_RELAXED);
+}
+
+
 #ifdef LINUX
-        if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) {
-            log_err("failed to initialize");
-            return -1;
-        }
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define ev_futex_wait(addr, val, ts) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, ts, NULL, 0)
+#define ev_futex_wake(addr) syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ev_cpu_relax() __builtin_ia32_pause()
+#else
+#define ev_cpu_relax() __asm__ __volatile__("" ::: "memory")
 #endif
+
+static inline uint64_t ev_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * (uint64_t)EV_SEC + t.tv_nsec;
+}
+
+
+int ev_init(ev_t *ev, timeout_t timeout)
+{
+    memset(ev, 0, sizeof(ev_t));
+    ev->timeout = ev_has_timeout(timeout) ? timeout : 0;
+    ev->spin = EV_SPIN_MIN;
+    return 0;
+}
+
+
+void ev_clear(ev_t *ev)
+{
+    __atomic_store_n(&ev->pending, 0, __ATOMIC_SEQ_CST);
+}
+
+
+// The futex is only touched when a waiter has parked. The pending flag is
+// stored before the waiters are read, and a waiter registers itself before
+// reading the flag, so one of them always sees the other.
+void ev_set(ev_t *ev)
+{
+    __atomic_store_n(&ev->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_store_n(&ev->set_time, ev_now(), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+        ev_futex_wake(&ev->seq);
+    }
+}
+
+
+static inline bool ev_consume(ev_t *ev)
+{
+    return __atomic_load_n(&ev->pending, __ATOMIC_RELAXED) && __atomic_exchange_n(&ev->pending, 0, __ATOMIC_SEQ_CST);
+}
+
+
+// The spin budget doubles when spinning catches an event and halves when it does not
+static inline bool ev_spin(ev_t *ev)
+{
+    int spin = ev->spin;
+
+    for (int i = 0; i < spin; i++) {
+        if (ev_consume(ev)) {
+            if (spin < EV_SPIN_MAX)
+                ev->spin = spin * 2;
+            ev_stat_inc(ev, spins, 1);
+            return true;
+        }
+        ev_cpu_relax();
+    }
+    if (spin > EV_SPIN_MIN)
+        ev->spin = spin / 2;
+    return false;
+}
+
+
+static int ev_park(ev_t *ev, timeout_t timeout, bool timed)
+{
+    int ret = 0;
+    uint64_t deadline = timed ? ev_now() + timeout : 0;
+
+    __atomic_add_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+    while (true) {
+        struct timespec t;
+        struct timespec *pt = NULL;
+        uint32_t seq = __atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST);
+
+        if (ev_consume(ev))
+            break;
+        if (timed) {
+            uint64_t now = ev_now();
+
+            if (now >= deadline) {
+                ev_stat_inc(ev, timeouts, 1);
+                ret = ETIMEDOUT;
+                break;
+            }
+            t.tv_sec = (deadline - now) / EV_SEC;
+            t.tv_nsec = (deadline - now) % EV_SEC;
+            pt = &t;
+        }
+        if (!ev_futex_wait(&ev->seq, seq, pt) || (EAGAIN == errno)) {
+            if (__atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST) != seq) {
+                uint64_t set_time = __atomic_load_n(&ev->set_time, __ATOMIC_RELAXED);
+                uint64_t now = ev_now();
+
+                ev_stat_inc(ev, wakeups, 1);
+                if (now > set_time)
+                    ev_stat_inc(ev, latency, now - set_time);
+                ev_consume(ev);
+                break;
+            }
+            ev_stat_inc(ev, spurious, 1);
+        } else if (EINTR == errno)
+            ev_stat_inc(ev, spurious, 1);
+    }
+    __atomic_sub_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+
+static inline int ev_do_wait(ev_t *ev, timeout_t timeout, bool timed)
+{
+    if (ev_consume(ev) || ev_spin(ev))
+        return 0;
+    if (timed && !timeout) {
+        ev_stat_inc(ev, timeouts, 1);
+        return ETIMEDOUT;
+    }
+    return ev_park(ev, timeout, timed);
+}
+
+
+int ev_wait(ev_t *ev)
+{
+    return ev_do_wait(ev, ev->timeout, ev->timeout != 0);
+}
+
+
+// Waits for at most the given timeout (nsec), which overrides the one of ev.
+int ev_timedwait(ev_t *ev, timeout_t timeout)
+{
+    return ev_do_wait(ev, timeout, true);
+}
+#else
+int ev_init(ev_t *ev, timeout_t timeout)
+{
+    memset(&ev->stat, 0, sizeof(ev_stat_t));
+    if (ev_has_timeout(timeout)) {
         ev->timeout = timeout;
         ev->sec = timeout / EV_SEC;
         ev->nsec = timeout % EV_SEC;
-        pthread_cond_init(&ev->cond, &attr);
     } else {
         ev->sec = 0;
         ev->nsec = 0;
         ev->timeout = 0;
-        pthread_cond_init(&ev->cond, NULL);
     }
+    pthread_cond_init(&ev->cond, NULL);
     pthread_mutex_init(&ev->mutex, NULL);
     ev->wait = false;
     return 0;
@@ -47,32 +199,49 @@ void ev_set(ev_t *ev)
 }
 
 
-int ev_wait(ev_t *ev)
+static int ev_do_wait(ev_t *ev, timeout_t timeout)
 {
     int ret = 0;
 
     pthread_mutex_lock(&ev->mutex);
     if (!ev->wait) {
         ev->wait = true;
-        if (ev->timeout) {
+        if (timeout) {
             unsigned long tmp;
-            struct timespec timeout;
+            struct timespec t;
 
-            clock_gettime(ev->timeout, &timeout);
-            tmp = timeout.tv_nsec + ev->nsec;
+            clock_gettime(CLOCK_REALTIME, &t);
+            tmp = t.tv_nsec + timeout % EV_SEC;
+            t.tv_sec += timeout / EV_SEC;
             if (tmp >= EV_SEC) {
-                timeout.tv_sec += 1 + ev->sec;
-                timeout.tv_nsec = tmp - EV_SEC;
-            } else {
-                timeout.tv_sec += ev->sec;
-                timeout.tv_nsec = tmp;
-            }
-            ret = pthread_cond_timedwait(&ev->cond, &ev->mutex, &timeout);
+                t.tv_sec += 1;
+                t.tv_nsec = tmp - EV_SEC;
+            } else
+                t.tv_nsec = tmp;
+            ret = pthread_cond_timedwait(&ev->cond, &ev->mutex, &t);
         } else
             pthread_cond_wait(&ev->cond, &ev->mutex);
         ev->wait = false;
+        if (ETIMEDOUT == ret)
+            ev_stat_inc(ev, timeouts, 1);
+        else
+            ev_stat_inc(ev, wakeups, 1);
     } else
         ev->wait = false;
     pthread_mutex_unlock(&ev->mutex);
     return ret;
 }
+
+
+int ev_wait(ev_t *ev)
+{
+    return ev_do_wait(ev, ev->timeout);
+}
+
+
+// Waits for at most the given timeout (nsec), which overrides the one of ev.
+int ev_timedwait(ev_t *ev, timeout_t timeout)
+{
+    return ev_do_wait(ev, timeout ? timeout : 1);
+}
+#endif
@@ -5,19 +5,47 @@
 
 #define EV_SEC       1000000000 // nsec
 #define EV_NOTIMEOUT -1
+#define EV_SPIN_MIN  16
+#define EV_SPIN_MAX  4096
 
 typedef struct {
+    uint64_t wakeups;
+    uint64_t spurious;
+    uint64_t timeouts;
+    uint64_t spins;
+    uint64_t latency; // nsec, accumulated over the wakeups
+} ev_stat_t;
+
+/*
+ * On Linux, an event is a futex word bumped by every ev_set that finds
+ * a parked waiter. A set with nobody parked only raises the pending flag,
+ * and a waiter spins for a while (adapted to how often spinning pays off)
+ * before it parks on the futex. A set is consumed by the first waiter
+ * that sees it, so an event is meant to be waited on by a single thread.
+ */
+typedef struct {
+    timeout_t timeout;
+#ifdef LINUX
+    uint32_t seq;
+    int spin;
+    int pending;
+    int waiters;
+    uint64_t set_time;
+#else
     int sec;
     int nsec;
     bool wait;
-    timeout_t timeout;
     pthread_cond_t cond;
     pthread_mutex_t mutex;
+#endif
+    ev_stat_t stat;
 } ev_t;
 
 void ev_set(ev_t *ev);
 int ev_wait(ev_t *ev);
+int ev_timedwait(ev_t *ev, timeout_t timeout);
 void ev_clear(ev_t *ev);
 int ev_init(ev_t *ev, timeout_t timeout);
+void ev_get_stat(ev_t *ev, ev_stat_t *stat);
 
 #endif
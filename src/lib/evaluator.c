@@ -78,35 +78,43 @@ void eval_response(char *buf, size_t size)
 }
 
 
+// A client host registers once for all of its client threads, whose
+// records share the socket to the listener of the host.
 rep_t eval_responder(req_t req)
 {
     hid_t hid;
+    void *desc;
     void *context;
-    eval_record_t *rec;
     struct in_addr addr;
     char dest[ADDR_SIZE];
 #ifdef HIGH_WATER_MARK
     int hwm = HIGH_WATER_MARK;
 #endif
-    rec = calloc(1, sizeof(eval_record_t));
-    assert(rec);
-    context = zmq_ctx_new();
     memcpy(&addr, &req, sizeof(struct in_addr));
+    hid = addr2hid(addr);
+    if (eval_lookup(&eval_status.tree, &hid))
+        return 0;
+    context = zmq_ctx_new();
     tcpaddr(dest, inet_ntoa(addr), listener_port);
-    rec->cnt = 0;
-    rec->hid = addr2hid(addr);
-    rec->desc = zmq_socket(context, ZMQ_PUSH);
+    desc = zmq_socket(context, ZMQ_PUSH);
 #ifdef HIGH_WATER_MARK
-    zmq_setsockopt(rec->desc, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+    zmq_setsockopt(desc, ZMQ_SNDHWM, &hwm, sizeof(hwm));
 #endif
-    if (zmq_connect(rec->desc, dest)) {
-        free(rec);
+    if (zmq_connect(desc, dest)) {
         log_err("failed to connect");
         return -EINVAL;
     }
-    if (eval_node_insert(&eval_status.tree, &rec->hid, &rec->node)) {
-        log_err("failed to insert");
-        assert(0);
+    for (int i = 0; i < CLIENT_THREADS; i++) {
+        eval_record_t *rec = calloc(1, sizeof(eval_record_t));
+
+        assert(rec);
+        rec->cnt = 0;
+        rec->desc = desc;
+        rec->hid = index2hid(addr, i);
+        if (eval_node_insert(&eval_status.tree, &rec->hid, &rec->node)) {
+            log_err("failed to insert");
+            assert(0);
+        }
     }
     log_func("addr=%s", inet_ntoa(addr));
     return 0;
@@ -2,6 +2,7 @@
 #define _EVALUATOR_H
 
 #include "util.h"
+#include "rbtree.h"
 
 // #define EVAL_ECHO
 // #define EVAL_LATENCY
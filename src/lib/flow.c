@@ -0,0 +1,153 @@
+#include "flow.h"
+#include "pool.h"
+#include "ev.h"
+#include "completion.h"
+
+struct {
+    uint64_t alloc;
+    uint64_t granted;
+    uint64_t advertised;
+    uint32_t credits[NODE_MAX];
+    uint32_t used[NODE_MAX];
+    uint64_t updated[NODE_MAX];
+    void *socket;
+    pthread_cond_t cond;
+    pthread_mutex_t lock;
+} flow_status;
+
+static inline uint64_t flow_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * (uint64_t)EV_SEC + t.tv_nsec;
+}
+
+
+// The records a server can still hold, from the arrival of a request to its
+// recycling, less the credits granted last time that have not arrived yet,
+// shared by the active clients (at least one credit each while there is room)
+static inline uint32_t flow_credits()
+{
+    int clients;
+    pool_stat_t stat;
+    uint64_t room;
+    uint64_t backlog;
+    uint64_t arrived;
+    uint32_t credits;
+
+    pool_get_stat(POOL_BATCH, &stat);
+    backlog = stat.alloc > stat.free ? stat.alloc - stat.free : 0;
+    room = backlog < FLOW_BACKLOG ? FLOW_BACKLOG - backlog : 0;
+    arrived = stat.alloc - flow_status.alloc;
+    if (flow_status.granted > arrived)
+        room = room > flow_status.granted - arrived ? room - (flow_status.granted - arrived) : 0;
+    clients = completion_count_clients(FLOW_ACTIVE);
+    if (clients < 1)
+        clients = 1;
+    credits = (room + clients - 1) / clients;
+    flow_status.alloc = stat.alloc;
+    flow_status.granted = (uint64_t)credits * clients;
+    return credits;
+}
+
+
+// Called by the deliverer, which owns the completion channel
+void flow_advertise()
+{
+    flow_credit_t credit;
+    uint64_t now = flow_now();
+
+    if (now - flow_status.advertised < FLOW_INTV)
+        return;
+    flow_status.advertised = now;
+    credit.hid = FLOW_HID;
+    credit.id = node_id;
+    credit.credits = flow_credits();
+    completion_publish(&credit, sizeof(flow_credit_t));
+}
+
+
+void *flow_receiver(void *arg)
+{
+    while (true) {
+        flow_credit_t credit;
+        int ret = zmq_recv(flow_status.socket, &credit, sizeof(flow_credit_t), 0);
+
+        if ((ret != sizeof(flow_credit_t)) || (credit.hid != FLOW_HID) || (credit.id < 0) || (credit.id >= nr_nodes))
+            continue;
+        pthread_mutex_lock(&flow_status.lock);
+        flow_status.credits[credit.id] = credit.credits;
+        flow_status.used[credit.id] = 0;
+        flow_status.updated[credit.id] = flow_now();
+        pthread_cond_broadcast(&flow_status.cond);
+        pthread_mutex_unlock(&flow_status.lock);
+    }
+    return NULL;
+}
+
+
+// Takes a credit from every server heard from within FLOW_TTL
+void flow_wait()
+{
+    pthread_mutex_lock(&flow_status.lock);
+    while (true) {
+        bool ready = true;
+        uint64_t now = flow_now();
+
+        for (int i = 0; i < nr_nodes; i++) {
+            if (flow_status.updated[i] && (now - flow_status.updated[i] < FLOW_TTL)
+                && (flow_status.used[i] >= flow_status.credits[i])) {
+                ready = false;
+                break;
+            }
+        }
+        if (ready) {
+            for (int i = 0; i < nr_nodes; i++)
+                flow_status.used[i]++;
+            break;
+        } else {
+            struct timespec t;
+
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += FLOW_INTV;
+            if (t.tv_nsec >= EV_SEC) {
+                t.tv_sec++;
+                t.tv_nsec -= EV_SEC;
+            }
+            pthread_cond_timedwait(&flow_status.cond, &flow_status.lock, &t);
+        }
+    }
+    pthread_mutex_unlock(&flow_status.lock);
+}
+
+
+void flow_connect()
+{
+    pthread_t thread;
+    void *context;
+    pthread_attr_t attr;
+    char addr[ADDR_SIZE];
+    hid_t hid = FLOW_HID;
+
+    memset(&flow_status, 0, sizeof(flow_status));
+    pthread_cond_init(&flow_status.cond, NULL);
+    pthread_mutex_init(&flow_status.lock, NULL);
+    if (-1 == completion_port) {
+        log_func("no completion port");
+        return;
+    }
+    context = zmq_ctx_new();
+    flow_status.socket = zmq_socket(context, ZMQ_SUB);
+    zmq_setsockopt(flow_status.socket, ZMQ_SUBSCRIBE, &hid, sizeof(hid_t));
+    for (int i = 0; i < nr_nodes; i++) {
+        tcpaddr(addr, nodes[i], completion_port);
+        if (zmq_connect(flow_status.socket, addr))
+            log_err("failed to connect to %s", addr);
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, flow_receiver, NULL);
+    pthread_attr_destroy(&attr);
+}
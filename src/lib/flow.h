@@ -0,0 +1,31 @@
+#ifndef _FLOW_H
+#define _FLOW_H
+
+#include "util.h"
+
+#define FLOW_HID     0          // the topic of credit frames, which no client has
+#define FLOW_BACKLOG 100000     // records a server holds before it stops granting credits
+#define FLOW_INTV    10000000   // nsec
+#define FLOW_TTL     1000000000 // nsec
+#define FLOW_ACTIVE  1          // sec, within which a client counts as active
+
+/*
+ * A server advertises its credits on the completion channel every
+ * FLOW_INTV, which are the requests it can still take split among the
+ * active clients, so that all of them together never send more than it
+ * can take before the next advertisement. A client spends one credit of
+ * every server per request and waits once any server runs out, until the
+ * server advertises again. A server that has been silent for
+ * FLOW_TTL is left out, so that a crashed one does not stop the clients.
+ */
+typedef struct {
+    hid_t hid;
+    int id;
+    uint32_t credits;
+} flow_credit_t;
+
+void flow_wait();
+void flow_connect();
+void flow_advertise();
+
+#endif
@@ -1,11 +1,16 @@
 #include "handler.h"
 #include "callback.h"
 #include "evaluator.h"
+#include "completion.h"
 
-void handle(char *buf, size_t size)
+void handle_batch(request_t *requests, int count)
 {
 #ifdef EVALUATE
-    evaluate(buf, size);
+    for (int i = 0; i < count; i++)
+        evaluate(requests[i].buf, requests[i].size);
+#endif
+    callback_batch(requests, count);
+#ifdef COMPLETION
+    complete(requests, count);
 #endif
-    callback(buf, size);
 }
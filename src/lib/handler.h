@@ -3,6 +3,6 @@
 
 #include "evaluator.h"
 
-void handle(char *buf, size_t size);
+void handle_batch(request_t *requests, int count);
 
 #endif
@@ -1,100 +1,119 @@
 #include "heartbeat.h"
 #include "collector.h"
-#include "requester.h"
 #include "responder.h"
+#include "timer.h"
 
 #define HEARTBEAT_COMMAND      1
-#define HEARTBEAT_WAITTIME     2    // sec
-#define HEARTBEAT_INTERVAL     1000 // msec
+#define HEARTBEAT_INTERVAL     1000000000 // nsec
 #define HEARTBEAT_RETRY_MAX    1
 
-typedef struct heartbeat_arg {
+typedef struct heartbeat_peer {
     int id;
+    int cnt;
+    bool wait;
+    bool ready;
+    void *socket;
     char addr[ADDR_SIZE];
-} heartbeat_arg_t;
+} heartbeat_peer_t;
+
+// The sockets of all peers share one context, which is never destroyed,
+// and drop their pending requests when closed, so closing the socket of a
+// dead peer never blocks the timer.
+static void *heartbeat_context = NULL;
 
-void *heartbeat_handle(void *ptr)
+static int heartbeat_open(heartbeat_peer_t *peer)
 {
-    int cnt;
-    int ret;
-    rep_t rep;
-    void *socket;
-    void *context;
-    req_t req = HEARTBEAT_COMMAND;
-    long intv = HEARTBEAT_INTERVAL;
-    long timeout = HEARTBEAT_INTERVAL / 1000;
-    heartbeat_arg_t *arg = (heartbeat_arg_t *)ptr;
-
-    assert((intv > 0) && (timeout > 0));
-    ret = request(arg->addr, &req, &rep);
-    if (ret || rep) {
-        log_err("failed to start, addr=%s", arg->addr);
-        return NULL;
+    int linger = 0;
+
+    peer->wait = false;
+    peer->socket = zmq_socket(heartbeat_context, ZMQ_REQ);
+    zmq_setsockopt(peer->socket, ZMQ_LINGER, &linger, sizeof(linger));
+    if (zmq_connect(peer->socket, peer->addr)) {
+        log_err("failed to connect, addr=%s", peer->addr);
+        zmq_close(peer->socket);
+        peer->socket = NULL;
+        return -EINVAL;
     }
-    while (true) {
-        context = zmq_ctx_new();
-        socket = zmq_socket(context, ZMQ_REQ);
-        ret = zmq_connect(socket, arg->addr);
-        if (ret) {
-            log_err("failed to connect, addr=%s", arg->addr);
-            sleep(HEARTBEAT_WAITTIME);
-            continue;
+    return 0;
+}
+
+
+static void heartbeat_close(heartbeat_peer_t *peer)
+{
+    zmq_close(peer->socket);
+    peer->socket = NULL;
+    peer->wait = false;
+}
+
+
+static void heartbeat_miss(heartbeat_peer_t *peer)
+{
+    peer->cnt++;
+    if (peer->cnt == HEARTBEAT_RETRY_MAX) {
+        peer->cnt = 0;
+        if (available_nodes & node_mask[peer->id]) {
+            debug_log_after_crash();
+            collector_fault(peer->id);
         }
-        cnt = 0;
-        while (true) {
-            zmq_pollitem_t item = {socket, 0, ZMQ_POLLIN, 0};
-
-            ret = zmq_send(socket, &req, sizeof(req_t), 0);
-            if (ret == sizeof(req_t)) {
-                zmq_poll(&item, 1, intv);
-                if (item.revents & ZMQ_POLLIN) {
-                    ret = zmq_recv(socket, &rep, sizeof(rep_t), 0);
-                    if ((ret == sizeof(rep_t)) && !rep) {
-                        sleep(timeout);
-                        cnt = 0;
-                        continue;
-                    }
-                }
-            }
-            cnt += 1;
-            if (cnt == HEARTBEAT_RETRY_MAX) {
-                if (available_nodes & node_mask[arg->id]) {
-                    debug_log_after_crash();
-                    collector_fault(arg->id);
-                }
-                break;
+    }
+    heartbeat_close(peer);
+}
+
+
+// Runs on the timer once per interval, the reply to the previous request
+// is due by then. The first request only waits for the peer to start.
+void heartbeat_tick(void *ptr)
+{
+    req_t req = HEARTBEAT_COMMAND;
+    heartbeat_peer_t *peer = (heartbeat_peer_t *)ptr;
+
+    if (!peer->socket && heartbeat_open(peer))
+        return;
+    if (peer->wait) {
+        rep_t rep;
+        int ret = zmq_recv(peer->socket, &rep, sizeof(rep_t), ZMQ_DONTWAIT);
+
+        if (!peer->ready) {
+            if (ret != sizeof(rep_t))
+                return;
+            if (rep) {
+                log_err("failed to start, addr=%s", peer->addr);
+                return;
             }
-        }
-        zmq_close(socket);
-        zmq_ctx_destroy(context);
+            peer->ready = true;
+        } else if ((ret != sizeof(rep_t)) || rep) {
+            heartbeat_miss(peer);
+            if (heartbeat_open(peer))
+                return;
+        } else
+            peer->cnt = 0;
     }
-    free(arg);
-    return NULL;
+    if (zmq_send(peer->socket, &req, sizeof(req_t), ZMQ_DONTWAIT) == sizeof(req_t))
+        peer->wait = true;
+    else if (peer->ready)
+        heartbeat_miss(peer);
 }
 
 
 void heartbeat_connect()
 {
-    int i;
-    pthread_t thread;
-    pthread_attr_t attr;
-
-    for (i = 0; i < nr_nodes; i++) {
+    heartbeat_context = zmq_ctx_new();
+    if (!heartbeat_context) {
+        log_err("failed to create context");
+        return;
+    }
+    for (int i = 0; i < nr_nodes; i++) {
         if (i != node_id) {
-            heartbeat_arg_t *arg;
+            heartbeat_peer_t *peer;
 
-            arg = (heartbeat_arg_t *)malloc(sizeof(heartbeat_arg_t));
-            if (!arg) {
+            peer = (heartbeat_peer_t *)calloc(1, sizeof(heartbeat_peer_t));
+            if (!peer) {
                 log_err("no memory");
                 return;
             }
-            arg->id = i;
-            tcpaddr(arg->addr, nodes[i], heartbeat_port);
-            pthread_attr_init(&attr);
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-            pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-            pthread_create(&thread, &attr, heartbeat_handle, arg);
-            pthread_attr_destroy(&attr);
+            peer->id = i;
+            tcpaddr(peer->addr, nodes[i], heartbeat_port);
+            timer_start(timer_new(heartbeat_tick, peer, HEARTBEAT_INTERVAL), 0);
         }
     }
 }
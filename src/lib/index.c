@@ -0,0 +1,99 @@
+#include "index.h"
+#include "util.h"
+
+#define INDEX_NR_BUCKETS (1 << 18)
+#define INDEX_NR_SHARDS  1024
+
+#define index_bucket(timestamp) (&index_status.buckets[index_hash(timestamp)])
+#define index_shard(timestamp) (&index_status.locks[index_hash(timestamp) & (INDEX_NR_SHARDS - 1)])
+#define index_match(t1, t2) (((t1)->sec == (t2)->sec) && ((t1)->usec == (t2)->usec) && ((t1)->hid == (t2)->hid))
+
+struct {
+    uint64_t waits;
+    pthread_mutex_t locks[INDEX_NR_SHARDS];
+    index_entry_t *buckets[INDEX_NR_BUCKETS];
+} index_status;
+
+static inline uint32_t index_hash(timestamp_t *timestamp)
+{
+    uint64_t key = ((uint64_t)timestamp->sec << 32) | timestamp->usec;
+
+    key ^= (uint64_t)timestamp->hid * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key & (INDEX_NR_BUCKETS - 1);
+}
+
+
+inline void index_lock(timestamp_t *timestamp)
+{
+    pthread_mutex_t *lock = index_shard(timestamp);
+
+    if (pthread_mutex_trylock(lock)) {
+        __sync_fetch_and_add(&index_status.waits, 1);
+        pthread_mutex_lock(lock);
+    }
+}
+
+
+inline void index_unlock(timestamp_t *timestamp)
+{
+    pthread_mutex_unlock(index_shard(timestamp));
+}
+
+
+index_entry_t *index_lookup(timestamp_t *timestamp)
+{
+    index_entry_t *entry;
+
+    for (entry = *index_bucket(timestamp); entry; entry = entry->next)
+        if (index_match(entry->timestamp, timestamp))
+            return entry;
+    return NULL;
+}
+
+
+void index_insert(index_entry_t *entry)
+{
+    index_entry_t **head = index_bucket(entry->timestamp);
+
+    assert(!index_lookup(entry->timestamp));
+    entry->next = *head;
+    *head = entry;
+}
+
+
+void index_remove(index_entry_t *entry)
+{
+    index_entry_t **pos;
+
+    for (pos = index_bucket(entry->timestamp); *pos; pos = &(*pos)->next) {
+        if (*pos == entry) {
+            *pos = entry->next;
+            entry->next = NULL;
+            return;
+        }
+    }
+    log_err("failed to remove");
+    assert(0);
+}
+
+
+void index_prefetch(timestamp_t *timestamp)
+{
+    __builtin_prefetch(index_bucket(timestamp));
+}
+
+
+uint64_t index_get_waits()
+{
+    return index_status.waits;
+}
+
+
+void index_init()
+{
+    for (int i = 0; i < INDEX_NR_SHARDS; i++)
+        pthread_mutex_init(&index_status.locks[i], NULL);
+}
@@ -0,0 +1,23 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <tbc.h>
+
+struct record;
+
+typedef struct index_entry {
+    struct index_entry *next;
+    timestamp_t *timestamp;
+    struct record *record;
+} index_entry_t;
+
+void index_init();
+void index_lock(timestamp_t *timestamp);
+void index_unlock(timestamp_t *timestamp);
+void index_insert(index_entry_t *entry);
+void index_remove(index_entry_t *entry);
+uint64_t index_get_waits();
+void index_prefetch(timestamp_t *timestamp);
+index_entry_t *index_lookup(timestamp_t *timestamp);
+
+#endif
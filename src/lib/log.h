@@ -417,7 +417,7 @@ static inline void show_session(int id, int session, int cnt)
 
 #ifdef SHOW_IGNORE
 #define show_ignore(id, rec) do { \
-    if (log_is_valid() && is_valid(&rec->checked[id])) { \
+    if (log_is_valid() && is_valid(&rec->links[id].checked)) { \
         log_enable(); \
         gen_func_name(); \
         show_timestamp_details(get_func_name(), id, rec->timestamp); \
@@ -519,6 +519,86 @@ static inline void show_session(int id, int session, int cnt)
 #define show_record(...) do {} while (0)
 #endif
 
+#ifdef SHOW_POOL
+#define show_pool() do { \
+    if (log_is_valid()) { \
+        for (int _i = 0; _i < NR_POOLS; _i++) { \
+            pool_stat_t _stat; \
+            pool_get_stat(_i, &_stat); \
+            printf("pool: %s, alloc=%lu, free=%lu, arenas=%lu, refills=%lu, flushes=%lu\n", pool_names[_i], \
+                   (unsigned long)_stat.alloc, (unsigned long)_stat.free, (unsigned long)_stat.arenas, \
+                   (unsigned long)_stat.refills, (unsigned long)_stat.flushes); \
+        } \
+    } \
+} while (0)
+#else
+#define show_pool(...) do {} while (0)
+#endif
+
+#ifdef SHOW_LOCKS
+#define show_lock(name, waits) do { \
+    if (log_is_valid()) \
+        printf("lock: %s, waits=%lu\n", name, (unsigned long)(waits)); \
+} while (0)
+#else
+#define show_lock(...) do {} while (0)
+#endif
+
+#ifdef SHOW_NACK
+#define show_nack(sent, received, retx) do { \
+    if (log_is_valid()) \
+        printf("nack: sent=%lu, received=%lu, retransmitted=%lu\n", \
+               (unsigned long)(sent), (unsigned long)(received), (unsigned long)(retx)); \
+} while (0)
+#else
+#define show_nack(...) do {} while (0)
+#endif
+
+#ifdef SHOW_OUTBOX
+#define show_outbox(id, stat) do { \
+    if (log_is_valid()) \
+        printf("outbox: %d, backlog=%lu, peak=%lu, sent=%lu, dropped=%lu, slow=%lu, latency=%lu\n", id, \
+               (unsigned long)(stat)->backlog, (unsigned long)(stat)->peak, (unsigned long)(stat)->sent, \
+               (unsigned long)(stat)->dropped, (unsigned long)(stat)->slow, \
+               (unsigned long)((stat)->sent ? (stat)->latency / (stat)->sent : 0)); \
+} while (0)
+#else
+#define show_outbox(...) do {} while (0)
+#endif
+
+#ifdef SHOW_EV
+#define show_ev(name, ev) do { \
+    ev_stat_t _stat; \
+    ev_get_stat(ev, &_stat); \
+    if (log_is_valid()) \
+        printf("ev: %s, wakeups=%lu, spurious=%lu, timeouts=%lu, spins=%lu, latency=%lu\n", name, \
+               (unsigned long)_stat.wakeups, (unsigned long)_stat.spurious, (unsigned long)_stat.timeouts, \
+               (unsigned long)_stat.spins, (unsigned long)(_stat.wakeups ? _stat.latency / _stat.wakeups : 0)); \
+} while (0)
+#else
+#define show_ev(...) do {} while (0)
+#endif
+
+#ifdef SHOW_PIPELINE
+#define show_pipeline(ordering, delivery, reclamation) do { \
+    if (log_is_valid()) \
+        printf("pipeline: ordering=%lu, delivery=%lu, reclamation=%lu\n", \
+               (unsigned long)(ordering), (unsigned long)(delivery), (unsigned long)(reclamation)); \
+} while (0)
+#else
+#define show_pipeline(...) do {} while (0)
+#endif
+
+#ifdef SHOW_FLUSH
+#define show_flush(target, rate, avg, size, deadline, dep) do { \
+    if (log_is_valid()) \
+        printf("flush: target=%d, rate=%lu, avg_size=%lu, size=%lu, deadline=%lu, dep=%lu\n", target, \
+               (unsigned long)(rate), (unsigned long)(avg), (unsigned long)(size), (unsigned long)(deadline), (unsigned long)(dep)); \
+} while (0)
+#else
+#define show_flush(...) do {} while (0)
+#endif
+
 #ifdef SHOW_STATUS
 #define show_status() do { \
     const int cand_max = 2; \
@@ -533,8 +613,8 @@ static inline void show_session(int id, int session, int cnt)
             struct list_head *pos; \
             for (pos = candidates->next; pos != candidates; pos = pos->next) { \
                 char name[1024]; \
-                record_t *curr = list_entry(pos, record_t, cand[_i]); \
-                struct list_head *next = &curr->next[_i]; \
+                record_t *curr = record_entry(pos, _i, cand); \
+                struct list_head *next = &curr->links[_i].next; \
                 if (is_valid(next)) { \
                     int total = 0; \
                     int next_cnt = 0; \
@@ -547,9 +627,9 @@ static inline void show_session(int id, int session, int cnt)
                     show_bitmap_info(get_func_name(), "* receivers", curr->receivers); \
                     log_func_info("********************************************************************************************"); \
                     for (p = next->next; p != next; p = p->next) { \
-                        record_t *rec = list_entry(p, record_t, link[_i]); \
+                        record_t *rec = record_entry(p, _i, link); \
                         gen_ts_pair("next", rec, "cand", curr); \
-                        log_func_info("<%d> %s (ignore=%d, perceived=%d, checked=%d), %s (id=%d)",  next_cnt + 1, ts_fst(), rec->ignore, rec->perceived, is_valid(&rec->checked[_i]), ts_snd(), _i); \
+                        log_func_info("<%d> %s (ignore=%d, perceived=%d, checked=%d), %s (id=%d)",  next_cnt + 1, ts_fst(), rec->ignore, rec->perceived, is_valid(&rec->links[_i].checked), ts_snd(), _i); \
                         if (++next_cnt == next_max) \
                             break; \
                     } \
@@ -561,24 +641,24 @@ static inline void show_session(int id, int session, int cnt)
                     log_func_info("********************************************************************************************"); \
                 } \
                 for (int _j = 0; _j < nr_nodes; _j++) { \
-                    record_t *prev = curr->prev[_j]; \
+                    record_t *prev = curr->links[_j].prev; \
                     if (prev) { \
                         gen_ts_pair("blk", prev, "cand", curr); \
-                        log_func_info("[x] que%d=>%s (ignore=%d, perceived=%d, checked=%d), %s", _j, ts_fst(), prev->ignore, prev->perceived, is_valid(&prev->checked[_j]), ts_snd()); \
+                        log_func_info("[x] que%d=>%s (ignore=%d, perceived=%d, checked=%d), %s", _j, ts_fst(), prev->ignore, prev->perceived, is_valid(&prev->links[_j].checked), ts_snd()); \
                     } else { \
                         gen_ts_pair( "blk", NULL, "cand", curr); \
-                        log_func_info("[v] que%d=>%s (cand_count=%d, cand_checked=%d), %s", _j, ts_fst(), curr->count[_j], is_valid(&curr->checked[_i]), ts_snd()); \
+                        log_func_info("[v] que%d=>%s (cand_count=%d, cand_checked=%d), %s", _j, ts_fst(), curr->links[_j].count, is_valid(&curr->links[_i].checked), ts_snd()); \
                     } \
                 } \
                 for (int _j = 0; _j < nr_nodes; _j++) { \
-                    struct list_head *prev = curr->cand[_j].prev; \
+                    struct list_head *prev = curr->links[_j].cand.prev; \
                     if (prev && (prev != &tracker_status.candidates[_j])) { \
-                        record_t *rec = list_entry(prev, record_t, cand[_j]); \
+                        record_t *rec = record_entry(prev, _j, cand); \
                         gen_ts_pair("prev", rec, "cand", curr); \
-                        log_func_info("> que%d=>%s (ignore=%d, perceived=%d, checked=%d), %s", _j, ts_fst(), rec->ignore, rec->perceived, is_valid(&rec->checked[_j]), ts_snd()); \
+                        log_func_info("> que%d=>%s (ignore=%d, perceived=%d, checked=%d), %s", _j, ts_fst(), rec->ignore, rec->perceived, is_valid(&rec->links[_j].checked), ts_snd()); \
                     } else { \
                         gen_ts_pair( "prev", NULL, "cand", curr); \
-                        log_func_info("> que%d=>%s (cand_input=%d), %s", _j, ts_fst(), is_valid(&curr->input[_j]), ts_snd()); \
+                        log_func_info("> que%d=>%s (cand_input=%d), %s", _j, ts_fst(), is_valid(&curr->links[_j].input), ts_snd()); \
                     } \
                 } \
                 if (++cand_cnt == cand_max) \
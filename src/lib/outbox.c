@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include "outbox.h"
+#include "pool.h"
+#include "util.h"
+#include "ref.h"
+
+#define outbox_lock(outbox) pthread_mutex_lock(&(outbox)->lock)
+#define outbox_unlock(outbox) pthread_mutex_unlock(&(outbox)->lock)
+
+typedef struct {
+    bool droppable;
+    uint64_t time;
+    ref_msg_t *ref;
+    struct list_head list;
+} outbox_item_t;
+
+struct {
+    int total;
+    struct list_head head;
+    pthread_mutex_t lock;
+} outbox_status;
+
+static inline uint64_t outbox_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * (uint64_t)EV_SEC + t.tv_nsec;
+}
+
+
+void outbox_init()
+{
+    outbox_status.total = 0;
+    INIT_LIST_HEAD(&outbox_status.head);
+    pthread_mutex_init(&outbox_status.lock, NULL);
+    pool_create(POOL_OUTBOX, sizeof(outbox_item_t));
+}
+
+
+// Drops the oldest client message queued, which the peer asks for again
+static inline bool outbox_evict(outbox_t *outbox)
+{
+    outbox_item_t *item;
+
+    if (!outbox->messages)
+        return false;
+    list_for_each_entry(item, &outbox->head, list) {
+        if (item->droppable) {
+            list_del(&item->list);
+            outbox->length--;
+            outbox->messages--;
+            ref_put(item->ref);
+            pool_free(POOL_OUTBOX, item);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// A client message is dropped if the outbox has too many of them. Other
+// messages always get in while the outbox is below OUTBOX_MAX, and past it
+// they take the place of the oldest client message. With none left, the
+// peer is marked slow and skipped until its outbox drains, as a PUB socket
+// would at its high water mark, so the caller never waits for one peer.
+void outbox_push(outbox_t *outbox, ref_msg_t *ref, bool droppable)
+{
+    outbox_item_t *item;
+
+    outbox_lock(outbox);
+    if (outbox->slow)
+        goto drop;
+    if (droppable && ((outbox->messages >= OUTBOX_LENGTH) || (outbox->length >= OUTBOX_MAX)))
+        goto drop;
+    if ((outbox->length >= OUTBOX_MAX) && !outbox_evict(outbox)) {
+        outbox->slow = true;
+        outbox->stat.slow++;
+        goto drop;
+    }
+    item = pool_try_alloc(POOL_OUTBOX);
+    if (!item)
+        goto drop;
+    item->ref = ref_get(ref);
+    item->droppable = droppable;
+    item->time = outbox_now();
+    list_add_tail(&item->list, &outbox->head);
+    outbox->length++;
+    if (droppable)
+        outbox->messages++;
+    if (outbox->length > outbox->stat.peak)
+        outbox->stat.peak = outbox->length;
+    outbox_unlock(outbox);
+    ev_set(&outbox->ev);
+    return;
+drop:
+    outbox->stat.dropped++;
+    outbox_unlock(outbox);
+}
+
+
+// Takes everything queued at once, the messages stay in the backlog until
+// they are handed to the socket.
+void *outbox_sender(void *arg)
+{
+    outbox_t *outbox = (outbox_t *)arg;
+
+    while (true) {
+        int n = 0;
+        int m = 0;
+        uint64_t latency = 0;
+        struct list_head head;
+        outbox_item_t *item, *next;
+
+        ev_wait(&outbox->ev);
+        INIT_LIST_HEAD(&head);
+        outbox_lock(outbox);
+        list_splice(&outbox->head, &head);
+        INIT_LIST_HEAD(&outbox->head);
+        outbox_unlock(outbox);
+        list_for_each_entry_safe(item, next, &head, list) {
+            ref_send(item->ref, outbox->socket);
+            latency += outbox_now() - item->time;
+            if (item->droppable)
+                m++;
+            n++;
+            ref_put(item->ref);
+            pool_free(POOL_OUTBOX, item);
+        }
+        outbox_lock(outbox);
+        outbox->length -= n;
+        outbox->messages -= m;
+        outbox->stat.sent += n;
+        outbox->stat.latency += latency;
+        if (!outbox->length)
+            outbox->slow = false;
+        outbox_unlock(outbox);
+    }
+    return NULL;
+}
+
+
+outbox_t *outbox_create(void *socket)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    outbox_t *outbox = (outbox_t *)calloc(1, sizeof(outbox_t));
+
+    if (!outbox) {
+        log_err("no memory");
+        return NULL;
+    }
+    outbox->socket = socket;
+    ev_init(&outbox->ev, EV_NOTIMEOUT);
+    INIT_LIST_HEAD(&outbox->head);
+    pthread_mutex_init(&outbox->lock, NULL);
+    pthread_mutex_lock(&outbox_status.lock);
+    outbox->id = outbox_status.total++;
+    list_add_tail(&outbox->list, &outbox_status.head);
+    pthread_mutex_unlock(&outbox_status.lock);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, outbox_sender, outbox);
+    pthread_attr_destroy(&attr);
+    return outbox;
+}
+
+
+void outbox_show_stat()
+{
+#ifdef SHOW_OUTBOX
+    outbox_t *outbox;
+
+    pthread_mutex_lock(&outbox_status.lock);
+    list_for_each_entry(outbox, &outbox_status.head, list) {
+        outbox_stat_t stat;
+
+        outbox_lock(outbox);
+        stat = outbox->stat;
+        stat.backlog = outbox->length;
+        outbox_unlock(outbox);
+        show_outbox(outbox->id, &stat);
+    }
+    pthread_mutex_unlock(&outbox_status.lock);
+#endif
+}
@@ -0,0 +1,49 @@
+#ifndef _OUTBOX_H
+#define _OUTBOX_H
+
+#include <tbc.h>
+#include "list.h"
+#include "ev.h"
+
+#define OUTBOX_LENGTH 4096   // client messages queued for a peer
+#define OUTBOX_MAX    65536  // messages queued for a peer
+
+struct ref_msg;
+
+typedef struct {
+    uint64_t sent;
+    uint64_t dropped;
+    uint64_t slow;    // times the peer has been skipped
+    uint64_t backlog;
+    uint64_t peak;
+    uint64_t latency; // nsec, accumulated over the sent messages
+} outbox_stat_t;
+
+/*
+ * Each peer connected through its own socket has an outbox, and only the
+ * sender of the outbox touches that socket. A peer that falls behind can
+ * only fill its own outbox: past OUTBOX_LENGTH, the client requests to it
+ * (single messages or coalesced REQUESTS frames) are dropped and the peer
+ * asks for them again (see batch_nack). Batch, NACK and RETX frames are
+ * only dropped once the outbox is at OUTBOX_MAX with no client request
+ * left to drop, and then the peer is skipped until it catches up.
+ */
+typedef struct outbox {
+    int id;
+    void *socket;
+    int length;
+    int messages;
+    bool slow;
+    ev_t ev;
+    outbox_stat_t stat;
+    pthread_mutex_t lock;
+    struct list_head head;
+    struct list_head list;
+} outbox_t;
+
+void outbox_init();
+void outbox_show_stat();
+outbox_t *outbox_create(void *socket);
+void outbox_push(outbox_t *outbox, struct ref_msg *ref, bool droppable);
+
+#endif
@@ -16,6 +16,7 @@ int node_id = -1;
 int majority = -1;
 int nr_nodes = -1;
 int eval_intv = -1;
+int batch_latency = -1;
 int client_port = -1;
 int tracker_port = -1;
 int notifier_port = -1;
@@ -25,6 +26,8 @@ int generator_port = -1;
 int collector_port = -1;
 int heartbeat_port = -1;
 int evaluator_port = -1;
+int completion_port = -1;
+int resend_port = -1;
 
 bool quiet = true;
 char log_name[1024];
@@ -124,6 +127,10 @@ int parser_get_ports(yaml_node_t *start, yaml_node_t *node)
             evaluator_port = strtol(val_str, NULL, 10);
         } else if (!strcmp(key_str, "tracker")) {
             tracker_port = strtol(val_str, NULL, 10);
+        } else if (!strcmp(key_str, "completion")) {
+            completion_port = strtol(val_str, NULL, 10);
+        } else if (!strcmp(key_str, "resend")) {
+            resend_port = strtol(val_str, NULL, 10);
         }
     }
     if ((-1 == client_port)|| (-1 == generator_port)
@@ -135,6 +142,19 @@ int parser_get_ports(yaml_node_t *start, yaml_node_t *node)
     return 0;
 }
 
+int parser_get_latency(yaml_node_t *start, yaml_node_t *node)
+{
+    char *str = (char *)node->data.scalar.value;
+
+    batch_latency = strtol(str, NULL, 10);
+    if (batch_latency <= 0) {
+        log_err("invalid latency");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+
 int parse()
 {
     FILE *fp;
@@ -174,6 +194,8 @@ int parse()
             ret = parser_get_ports(start, val);
         else if (!strcmp(key_str, "servers"))
             ret = parser_get_servers(start, val);
+        else if (!strcmp(key_str, "latency"))
+            ret = parser_get_latency(start, val);
         if (ret)
             break;
     }
@@ -0,0 +1,203 @@
+#include <sys/mman.h>
+#include "pool.h"
+#include "util.h"
+
+// #define POOL_HUGEPAGE
+
+#define POOL_ALIGN       16
+#define POOL_ARENA_SIZE  (2 << 20)  // bytes
+#define POOL_CACHE_MAX   512        // objects
+#define POOL_CACHE_BATCH 128        // objects
+
+#define pool_lock(pool) pthread_mutex_lock(&(pool)->lock)
+#define pool_unlock(pool) pthread_mutex_unlock(&(pool)->lock)
+
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object_t;
+
+typedef struct {
+    int count;
+    uint64_t alloc;
+    uint64_t free;
+    pool_object_t *head;
+} pool_cache_t;
+
+typedef struct {
+    int count;
+    size_t size;
+    char *arena;
+    size_t remain;
+    pool_stat_t stat;
+    pool_object_t *head;
+    pthread_mutex_t lock;
+} pool_t;
+
+struct {
+    pool_t pools[NR_POOLS];
+} pool_status;
+
+static __thread pool_cache_t pool_caches[NR_POOLS];
+
+char pool_names[NR_POOLS][32] = {"batch", "record", "queue", "outbox"};
+
+static inline char *pool_new_arena()
+{
+    void *arena = MAP_FAILED;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#if defined(POOL_HUGEPAGE) && defined(MAP_HUGETLB)
+    arena = mmap(NULL, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+#endif
+    if (MAP_FAILED == arena)
+        arena = mmap(NULL, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (MAP_FAILED == arena)
+        return NULL;
+    return (char *)arena;
+}
+
+
+static inline pool_object_t *pool_carve(pool_t *pool)
+{
+    pool_object_t *obj;
+
+    if (pool->remain < pool->size) {
+        char *arena = pool_new_arena();
+
+        if (!arena)
+            return NULL;
+        pool->arena = arena;
+        pool->remain = POOL_ARENA_SIZE;
+        pool->stat.arenas++;
+    }
+    obj = (pool_object_t *)pool->arena;
+    pool->arena += pool->size;
+    pool->remain -= pool->size;
+    return obj;
+}
+
+
+static inline void pool_fold(pool_t *pool, pool_cache_t *cache)
+{
+    pool->stat.alloc += cache->alloc;
+    pool->stat.free += cache->free;
+    cache->alloc = 0;
+    cache->free = 0;
+}
+
+
+static void pool_refill(pool_type_t type, pool_cache_t *cache)
+{
+    pool_t *pool = &pool_status.pools[type];
+
+    assert(pool->size);
+    pool_lock(pool);
+    for (int i = 0; i < POOL_CACHE_BATCH; i++) {
+        pool_object_t *obj;
+
+        if (pool->head) {
+            obj = pool->head;
+            pool->head = obj->next;
+            pool->count--;
+        } else if (!(obj = pool_carve(pool)))
+            break;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    pool->stat.refills++;
+    pool_fold(pool, cache);
+    pool_unlock(pool);
+}
+
+
+static void pool_flush(pool_type_t type, pool_cache_t *cache)
+{
+    pool_object_t *head = cache->head;
+    pool_object_t *tail = head;
+    pool_t *pool = &pool_status.pools[type];
+
+    for (int i = 1; i < POOL_CACHE_BATCH; i++)
+        tail = tail->next;
+    cache->head = tail->next;
+    cache->count -= POOL_CACHE_BATCH;
+    pool_lock(pool);
+    tail->next = pool->head;
+    pool->head = head;
+    pool->count += POOL_CACHE_BATCH;
+    pool->stat.flushes++;
+    pool_fold(pool, cache);
+    pool_unlock(pool);
+}
+
+
+// Returns NULL if no arena can be mapped, for the callers that can drop
+// what they allocate for
+void *pool_try_alloc(pool_type_t type)
+{
+    pool_object_t *obj;
+    pool_cache_t *cache = &pool_caches[type];
+
+    if (!cache->head) {
+        pool_refill(type, cache);
+        if (!cache->head)
+            return NULL;
+    }
+    obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    cache->alloc++;
+    memset(obj, 0, pool_status.pools[type].size);
+    return obj;
+}
+
+
+void *pool_alloc(pool_type_t type)
+{
+    void *ptr = pool_try_alloc(type);
+
+    if (!ptr)
+        log_err("no memory, pool=%s", pool_names[type]);
+    return ptr;
+}
+
+
+void pool_free(pool_type_t type, void *ptr)
+{
+    pool_object_t *obj = (pool_object_t *)ptr;
+    pool_cache_t *cache = &pool_caches[type];
+
+    if (!obj)
+        return;
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->count++;
+    cache->free++;
+    if (cache->count > POOL_CACHE_MAX)
+        pool_flush(type, cache);
+}
+
+
+void pool_get_stat(pool_type_t type, pool_stat_t *stat)
+{
+    pool_t *pool = &pool_status.pools[type];
+
+    pool_lock(pool);
+    *stat = pool->stat;
+    pool_unlock(pool);
+}
+
+
+int pool_create(pool_type_t type, size_t size)
+{
+    pool_t *pool = &pool_status.pools[type];
+
+    if ((type >= NR_POOLS) || !size || (size > POOL_ARENA_SIZE)) {
+        log_err("invalid pool, type=%d, size=%zu", type, size);
+        return -EINVAL;
+    }
+    memset(pool, 0, sizeof(pool_t));
+    pool->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    return 0;
+}
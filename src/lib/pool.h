@@ -0,0 +1,30 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <tbc.h>
+
+typedef enum {
+    POOL_BATCH = 0,
+    POOL_RECORD,
+    POOL_QUEUE,
+    POOL_OUTBOX,
+    NR_POOLS,
+} pool_type_t;
+
+typedef struct {
+    uint64_t alloc;
+    uint64_t free;
+    uint64_t arenas;
+    uint64_t refills;
+    uint64_t flushes;
+} pool_stat_t;
+
+extern char pool_names[NR_POOLS][32];
+
+void pool_free(pool_type_t type, void *ptr);
+void *pool_alloc(pool_type_t type);
+void *pool_try_alloc(pool_type_t type);
+int pool_create(pool_type_t type, size_t size);
+void pool_get_stat(pool_type_t type, pool_stat_t *stat);
+
+#endif
@@ -1,6 +1,16 @@
 #include "publisher.h"
 #include "requester.h"
 #include "subscriber.h"
+#include "outbox.h"
+
+// The index of the pub_arg_t of the calling publisher thread
+static __thread int publisher_index = 0;
+
+int publisher_get_index()
+{
+    return publisher_index;
+}
+
 
 void publisher_init_pub(char *src, char *dest)
 {
@@ -110,6 +120,7 @@ void *publisher_start(void *ptr)
     if (!arg->type)
         arg->type = MULTICAST;
 
+    publisher_index = arg->index;
     memset(&sender, 0, sizeof(sender_desc_t));
     sender.sender = arg->sender;
     callback = arg->callback;
@@ -118,6 +129,8 @@ void *publisher_start(void *ptr)
 #ifdef HIGH_WATER_MARK
     zmq_setsockopt(frontend, ZMQ_RCVHWM, &hwm, sizeof(hwm));
 #endif
+    if (arg->timeout)
+        zmq_setsockopt(frontend, ZMQ_RCVTIMEO, &arg->timeout, sizeof(arg->timeout));
     if (strlen(arg->addr) > 0) {
         backend = zmq_socket(context, ZMQ_PUB);
 #ifdef HIGH_WATER_MARK
@@ -134,8 +147,10 @@ void *publisher_start(void *ptr)
                 sender.desc[0] = backend;
                 sender.total = 1;
             } else {
-                for (i = 0; i < arg->total; i++)
+                for (i = 0; i < arg->total; i++) {
                     sender.desc[i] = endpoints[i];
+                    sender.outbox[i] = outbox_create(endpoints[i]);
+                }
                 sender.total = arg->total;
             }
 
@@ -5,7 +5,9 @@
 
 typedef struct pub_arg {
     int type;
+    int index;
     int total;
+    int timeout;
     bool bypass;
     sender_t sender;
     sender_desc_t *desc;
@@ -15,6 +17,7 @@ typedef struct pub_arg {
     char dest[NODE_MAX][ADDR_SIZE];
 } pub_arg_t;
 
+int publisher_get_index();
 void *publisher_start(void *ptr);
 
 #endif
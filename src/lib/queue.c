@@ -1,399 +1,316 @@
+#include "pool.h"
 #include "queue.h"
 #include "util.h"
 #include "timestamp.h"
 
-#define QUEUE_ASSERT
-
 struct {
-    queue_item_t queues[NODE_MAX];
+    queue_t queues[NODE_MAX];
 } queue_status;
 
-static inline int queue_item_compare(const void *t1, const void *t2)
+static const timestamp_t queue_key_max = {(timestamp_sec_t)-1, (timestamp_usec_t)-1, (hid_t)-1};
+
+static inline bool queue_less(const timestamp_t *t1, const timestamp_t *t2)
+{
+    if (t1->sec != t2->sec)
+        return t1->sec < t2->sec;
+    else if (t1->usec != t2->usec)
+        return t1->usec < t2->usec;
+    else
+        return t1->hid < t2->hid;
+}
+
+
+static inline bool queue_equal(const timestamp_t *t1, const timestamp_t *t2)
 {
-    return -timestamp_compare(t1, t2);
+    return (t1->sec == t2->sec) && (t1->usec == t2->usec) && (t1->hid == t2->hid);
 }
 
 
 void queue_init()
 {
     for (int i = 0; i < NODE_MAX; i++) {
-        queue_item_t *queue = &queue_status.queues[i];
+        queue_t *queue = &queue_status.queues[i];
 
-        memset(queue, 0, sizeof(queue_item_t));
-        INIT_LIST_HEAD(&queue->head);
+        memset(queue, 0, sizeof(queue_t));
         INIT_LIST_HEAD(&queue->list);
-        rb_tree_new(&queue->root, queue_item_compare);
     }
+    pool_create(POOL_QUEUE, sizeof(queue_node_t));
 }
 
 
-static inline queue_item_t *queue_new_item(int id, queue_item_t *parent, record_t *record, const int size)
+static inline queue_node_t *queue_node_new(bool leaf)
 {
-    if (parent->count < size) {
-        queue_item_t *item = calloc(1, sizeof(queue_item_t));
-
-        item->rec = record;
-        INIT_LIST_HEAD(&item->head);
-        list_add_tail(&item->list, &parent->head);
-        rb_tree_new(&item->root, queue_item_compare);
-        queue_rbtree_insert(&parent->root, record->timestamp, &item->node);
-        item->parent = parent;
-        parent->count++;
-        return item;
-    } else {
-        log_err("too many items");
-        return NULL;
-    }
+    queue_node_t *node = pool_alloc(POOL_QUEUE);
+
+    node->leaf = leaf;
+    return node;
 }
 
 
-static inline queue_item_t *queue_new_chunk(int id, queue_item_t *queue, record_t *record)
+static inline timestamp_t *queue_node_min(queue_node_t *node)
 {
-    queue_item_t *chunk = queue_new_item(id, queue, record, QUEUE_CHUNK_MAX);
+    timestamp_t *min = &node->keys[0];
+
+    assert(node->count > 0);
+    for (int i = 1; i < node->count; i++)
+        if (queue_less(&node->keys[i], min))
+            min = &node->keys[i];
+    return min;
+}
 
-    if (chunk && (queue->count != 1))
-        if (timestamp_compare(queue->rec->timestamp, record->timestamp) > 0)
-            queue->rec = record;
 
-    show_queue(id, record, "queue_count=%d", queue->count);
-    return chunk;
+static inline int queue_node_index(queue_node_t *parent, queue_node_t *child)
+{
+    for (int i = 0; i < parent->count; i++)
+        if (parent->children[i] == child)
+            return i;
+    log_err("failed to find child");
+    return -1;
 }
 
 
-static inline queue_item_t *queue_new_block(int id, queue_item_t *chunk, record_t *record)
+static inline void queue_node_attach(queue_node_t *parent, queue_node_t *child)
 {
-    queue_item_t *block = queue_new_item(id, chunk, record, QUEUE_BLOCK_MAX);
+    int n = parent->count;
 
-    if (block && (chunk->count != 1)) {
-        timestamp_t *timestamp = record->timestamp;
+    assert(n < QUEUE_FANOUT);
+    parent->children[n] = child;
+    parent->keys[n] = child->count > 0 ? *queue_node_min(child) : queue_key_max;
+    parent->count++;
+    child->parent = parent;
+}
 
-        if (timestamp_compare(chunk->rec->timestamp, timestamp) > 0) {
-            queue_item_t *queue = chunk->parent;
 
-            queue_rbtree_remove(&queue->root, &chunk->node);
-            queue_rbtree_insert(&queue->root, timestamp, &chunk->node);
-            if (timestamp_compare(queue->rec->timestamp, timestamp) > 0)
-                queue->rec = record;
-            chunk->rec = record;
-        }
+// Append a leaf on the rightmost path, growing the tree by one level
+// when every node on that path is full.
+static inline queue_node_t *queue_grow(queue_t *queue)
+{
+    int level = 1;
+    queue_node_t *leaf = queue_node_new(true);
+    queue_node_t *node = queue->tail->parent;
+
+    while (node && (node->count == QUEUE_FANOUT)) {
+        node = node->parent;
+        level++;
+    }
+    if (!node) {
+        node = queue_node_new(false);
+        queue_node_attach(node, queue->root);
+        queue->root = node;
+        queue->height++;
+    }
+    for (int i = level - 1; i > 0; i--) {
+        queue_node_t *child = queue_node_new(false);
+
+        queue_node_attach(node, child);
+        node = child;
     }
-    show_queue(id, record, "chunk_count=%d", chunk->count);
-    return block;
+    queue_node_attach(node, leaf);
+    queue->tail = leaf;
+    return leaf;
 }
 
 
-static inline void queue_add_item(int id, queue_item_t *block, record_t *record)
+static inline void queue_add(int id, queue_t *queue, record_t *record)
 {
+    queue_node_t *node;
+    queue_node_t *leaf = queue->tail;
     timestamp_t *timestamp = record->timestamp;
 
-    if (block->rec != record) {
-        assert(block->rec);
-        if (timestamp_compare(block->rec->timestamp, timestamp) > 0) {
-            queue_item_t *chunk = block->parent;
+    if (!leaf) {
+        leaf = queue_node_new(true);
+        queue->root = leaf;
+        queue->tail = leaf;
+    } else if (leaf->count == QUEUE_FANOUT)
+        leaf = queue_grow(queue);
+
+    leaf->keys[leaf->count] = *timestamp;
+    leaf->records[leaf->count] = record;
+    leaf->count++;
+    record->links[id].leaf = leaf;
+    for (node = leaf; node->parent; node = node->parent) {
+        queue_node_t *parent = node->parent;
+        timestamp_t *key = &parent->keys[parent->count - 1];
+
+        assert(parent->children[parent->count - 1] == node);
+        if (!queue_less(timestamp, key))
+            break;
+        *key = *timestamp;
+    }
+    show_queue(id, record, "leaf_count=%d (leaf=0x%llx)", leaf->count, (unsigned long long)leaf);
+}
 
-            assert(block->rec);
-            if ((chunk->rec == block->rec) || (timestamp_compare(chunk->rec->timestamp, timestamp) > 0)) {
-                queue_item_t *queue = chunk->parent;
 
-                assert(queue->rec);
-                if ((queue->rec == chunk->rec) || (timestamp_compare(queue->rec->timestamp, timestamp) > 0))
-                    queue->rec = record;
+// Return the latest record under node with a timestamp smaller than the
+// given one; the caller has checked that the subtree minimum is smaller.
+static inline record_t *queue_find_prev(queue_node_t *node, timestamp_t *timestamp)
+{
+    int i;
 
-                queue_rbtree_remove(&queue->root, &chunk->node);
-                queue_rbtree_insert(&queue->root, timestamp, &chunk->node);
-                chunk->rec = record;
-            }
-            queue_rbtree_remove(&chunk->root, &block->node);
-            queue_rbtree_insert(&chunk->root, timestamp, &block->node);
-            block->rec = record;
-        }
+    while (!node->leaf) {
+        for (i = node->count - 1; i >= 0; i--)
+            if (queue_less(&node->keys[i], timestamp))
+                break;
+        assert(i >= 0);
+        node = node->children[i];
     }
-    block->count++;
-    record->block[id] = block;
-    list_add_tail(&record->item_list[id], &block->head);
-    queue_rbtree_insert(&block->root, timestamp, &record->item_node[id]);
-    show_queue(id, record, "block_count=%d (block=0x%llx)", block->count, (unsigned long long)block);
+    for (i = node->count - 1; i >= 0; i--)
+        if (queue_less(&node->keys[i], timestamp))
+            return node->records[i];
+    log_err("failed to find prev item");
+    return NULL;
 }
 
 
-static inline void queue_add(int id, queue_item_t *queue, record_t *record)
+static inline int queue_leaf_index(queue_node_t *leaf, record_t *record)
 {
-    queue_item_t *chunk;
-    queue_item_t *block;
-    struct list_head *head = &queue->head;
-
-    if (!list_empty(head)) {
-        chunk = list_entry(head->prev, queue_item_t, list);
-        assert(!list_empty(&chunk->head));
-        block = list_entry(chunk->head.prev, queue_item_t, list);
-        if (block->count == QUEUE_ENTRY_MAX) {
-            if (chunk->count == QUEUE_BLOCK_MAX) {
-                chunk = queue_new_chunk(id, queue, record);
-                block = queue_new_block(id, chunk, record);
-            } else
-                block = queue_new_block(id, chunk, record);
-        }
-    } else {
-        chunk = queue_new_chunk(id, queue, record);
-        block = queue_new_block(id, chunk, record);
-        queue->rec = record;
-    }
-    queue_add_item(id, block, record);
+    for (int i = 0; i < leaf->count; i++)
+        if (leaf->records[i] == record)
+            return i;
+    log_err("failed to find record");
+    return -1;
 }
 
 
 record_t *queue_update_prev(int id, record_t *prev, record_t *curr)
 {
-    struct list_head *i;
-    struct list_head *j;
-    struct list_head *k;
-    queue_item_t *block = prev->block[id];
-    queue_item_t *chunk = block->parent;
-    queue_item_t *queue = chunk->parent;
+    int i;
+    queue_node_t *node = prev->links[id].leaf;
     timestamp_t *timestamp = curr->timestamp;
 
-    for (i = prev->item_list[id].prev; i != &block->head; i = i->prev) {
-        record_t *rec = list_entry(i, record_t, item_list[id]);
-
-        if (timestamp_compare(rec->timestamp, timestamp) < 0) {
-            show_prev_str(id, curr, rec, "find prev item in the same block");
-            return rec;
+    for (i = queue_leaf_index(node, prev) - 1; i >= 0; i--) {
+        if (queue_less(&node->keys[i], timestamp)) {
+            show_prev_str(id, curr, node->records[i], "find prev item in the same leaf");
+            return node->records[i];
         }
     }
-    for (i = block->list.prev; i != &chunk->head; i = i->prev) {
-        block = list_entry(i, queue_item_t, list);
-        if (timestamp_compare(block->rec->timestamp, timestamp) < 0) {
-            for (j = block->head.prev; j != &block->head; j = j->prev) {
-                record_t *rec = list_entry(j, record_t, item_list[id]);
-
-                if (timestamp_compare(rec->timestamp, timestamp) < 0) {
-                    show_prev_str(id, curr, rec, "find prev item in the same chunk");
-                    return rec;
-                }
-            }
-            log_err("failed to find prev item in the same chunk");
-        }
-    }
-    for (i = chunk->list.prev; i != &queue->head; i = i->prev) {
-        chunk = list_entry(i, queue_item_t, list);
-        if (timestamp_compare(chunk->rec->timestamp, timestamp) < 0) {
-            for (j = chunk->head.prev; j != &chunk->head; j = j->prev) {
-                block = list_entry(j, queue_item_t, list);
-                if (timestamp_compare(block->rec->timestamp, timestamp) < 0) {
-                    for (k = block->head.prev; k != &block->head; k = k->prev) {
-                        record_t *rec = list_entry(k, record_t, item_list[id]);
-
-                        if (timestamp_compare(rec->timestamp, timestamp) < 0) {
-                            show_prev_str(id, curr, rec, "find prev item");
-                            return rec;
-                        }
-                    }
-                    log_err("failed to find prev item");
-                }
-            }
-            log_err("failed to find prev item");
-        }
-    }
-    return NULL;
-}
+    while (node->parent) {
+        queue_node_t *parent = node->parent;
 
+        for (i = queue_node_index(parent, node) - 1; i >= 0; i--) {
+            if (queue_less(&parent->keys[i], timestamp)) {
+                record_t *rec = queue_find_prev(parent->children[i], timestamp);
 
-static inline void queue_push_item(int id, queue_item_t *queue, record_t *record, bool earliest)
-{
-    struct list_head *head = &queue->head;
-
-    if (!list_empty(head) && !earliest) {
-        struct list_head *i;
-        timestamp_t *timestamp = record->timestamp;
-
-        for (i = head->prev; i != head; i = i->prev) {
-            queue_item_t *chunk = list_entry(i, queue_item_t, list);
-
-            if (timestamp_compare(chunk->rec->timestamp, timestamp) < 0) {
-                struct list_head *j;
-
-                for (j = chunk->head.prev; j != &chunk->head; j = j->prev) {
-                    queue_item_t *block = list_entry(j, queue_item_t, list);
-
-                    if (timestamp_compare(block->rec->timestamp, timestamp) < 0) {
-                        struct list_head *k;
-
-                        for (k = block->head.prev; k != &block->head; k = k->prev) {
-                            record_t *rec = list_entry(k, record_t, item_list[id]);
-
-                            if (timestamp_compare(rec->timestamp, timestamp) < 0) {
-                                if (is_empty(&rec->next[id]))
-                                    INIT_LIST_HEAD(&rec->next[id]);
-                                list_add_tail(&record->link[id], &rec->next[id]);
-                                record->prev[id] = rec;
-                                show_prev(id, record, rec, NULL);
-                                break;
-                            }
-                        }
-                        assert(k != &block->head);
-                        break;
-                    }
-                }
-                assert(j != &chunk->head);
-                break;
+                show_prev_str(id, curr, rec, "find prev item");
+                return rec;
             }
         }
-        assert(i != head);
+        node = parent;
     }
-    queue->seq++;
-    queue->length++;
-    queue_add(id, queue, record);
+    return NULL;
 }
 
 
 void queue_push(int id, record_t *record, bool *earliest)
 {
-    queue_item_t *queue = &queue_status.queues[id];
+    queue_t *queue = &queue_status.queues[id];
+    timestamp_t *timestamp = record->timestamp;
 
-    assert(record->timestamp);
+    assert(timestamp);
     if (queue->length < QUEUE_LENGTH) {
-        record_t *rec = queue->rec;
-
-        if (!rec || (timestamp_compare(record->timestamp, rec->timestamp) < 0)) {
-            queue_push_item(id, queue, record, true);
+        if (!queue->root || queue_less(timestamp, queue_node_min(queue->root)))
             *earliest = true;
-        } else
-            queue_push_item(id, queue, record, false);
+        else {
+            record_t *rec = queue_find_prev(queue->root, timestamp);
+
+            if (is_empty(&rec->links[id].next))
+                INIT_LIST_HEAD(&rec->links[id].next);
+            list_add_tail(&record->links[id].link, &rec->links[id].next);
+            record->links[id].prev = rec;
+            show_prev(id, record, rec, NULL);
+        }
+        queue->seq++;
+        queue->length++;
+        queue_add(id, queue, record);
         show_queue(id, record, "len=%d seq=%d (id=%d)", queue->length, queue->seq, id);
     } else
         log_err("no space, len=%d, seq=%d (id=%d)", queue->length, queue->seq, id);
 }
 
 
-
-static inline void queue_del_item(queue_item_t *item)
+// A key was removed from node, refresh the ancestors that took it as
+// their minimum.
+static inline void queue_update_keys(queue_node_t *node, timestamp_t *removed)
 {
-    queue_item_t *parent = item->parent;
-    struct list_head *list = &item->list;
-
-    assert(!item->count);
-    queue_remove_list(list);
-    queue_item_counter_dec(parent);
-    rb_tree_destroy(&item->root);
-    free(item);
-}
-
-
-static inline void queue_update_chunk(int id, queue_item_t *chunk, record_t *record)
-{
-    rbtree_node_t *node = NULL;
-    queue_item_t *block = NULL;
-    queue_item_t *queue = chunk->parent;
-
-    assert(chunk->count > 0);
-    queue_rbtree_rightmost(&chunk->root, &node);
-    block = list_entry(node, queue_item_t, node);
-    assert(block->count > 0);
-    assert(chunk->rec != block->rec);
-    chunk->rec = block->rec;
-    queue_rbtree_remove(&queue->root, &chunk->node);
-    queue_rbtree_insert(&queue->root, block->rec->timestamp, &chunk->node);
-    assert(queue->rec);
-    if (queue->rec == record) {
-        queue_rbtree_rightmost(&queue->root, &node);
-        chunk = list_entry(node, queue_item_t, node);
-        assert(queue->rec != chunk->rec);
-        queue->rec = chunk->rec;
-        show_queue(id, chunk->rec, "update chunk_rec and queue_rec");
-    } else
-        show_queue(id, chunk->rec, "update chunk_rec only");
+    while (node->parent) {
+        queue_node_t *parent = node->parent;
+        timestamp_t *key = &parent->keys[queue_node_index(parent, node)];
+
+        if (!queue_equal(key, removed))
+            break;
+        *key = *queue_node_min(node);
+        node = parent;
+    }
 }
 
 
-static inline void queue_remove_block_item(int id, queue_item_t *block, record_t *record)
+// Drop an empty node along with the ancestors it leaves empty, then
+// shrink the tree while the root has a single child.
+static inline void queue_del_node(queue_t *queue, queue_node_t *node)
 {
-    record_t *rec = NULL;
-    queue_item_t *chunk = block->parent;
-
-    queue_rbtree_remove(&block->root, &record->item_node[id]);
-    queue_remove_list(&record->item_list[id]);
-    if (block->count > 1) {
-        rbtree_node_t *node;
-
-        queue_rbtree_rightmost(&block->root, &node);
-        rec = list_entry(node, record_t, item_node[id]);
-#ifdef QUEUE_ASSERT
-        if (timestamp_compare(rec->timestamp, record->timestamp) <= 0) {
-            show_prev(id, rec, record, NULL);
-            log_err("failed to remove record");
+    queue_node_t *parent;
+
+    while ((parent = node->parent)) {
+        int i = queue_node_index(parent, node);
+        int n = parent->count - i - 1;
+        timestamp_t removed = parent->keys[i];
+
+        assert(!node->count);
+        memmove(&parent->keys[i], &parent->keys[i + 1], n * sizeof(timestamp_t));
+        memmove(&parent->children[i], &parent->children[i + 1], n * sizeof(queue_node_t *));
+        parent->count--;
+        pool_free(POOL_QUEUE, node);
+        if (parent->count > 0) {
+            queue_update_keys(parent, &removed);
+            break;
         }
-#endif
+        node = parent;
     }
-    queue_item_counter_dec(block);
-    block->rec = rec;
-    queue_rbtree_remove(&chunk->root, &block->node);
-    if (rec) {
-        queue_rbtree_insert(&chunk->root, rec->timestamp, &block->node);
-        if (chunk->rec == record)
-            queue_update_chunk(id, chunk, record);
-    } else if (chunk->count > 1) {
-        assert(!block->count);
-        if (chunk->rec == record)
-            queue_update_chunk(id, chunk, record);
-        queue_del_item(block);
-    } else {
-        queue_item_t *queue = chunk->parent;
-
-        assert(!block->count);
-        assert(queue->count > 0);
-        assert(1 == chunk->count);
-        assert(chunk->rec == record);
-
-        queue_rbtree_remove(&queue->root, &chunk->node);
-        if (queue->rec == chunk->rec) {
-            if (queue->count > 1) {
-                queue_item_t *nu;
-                rbtree_node_t *node;
-
-                queue_rbtree_rightmost(&queue->root, &node);
-                nu = list_entry(node, queue_item_t, node);
-                assert(nu->rec != queue->rec);
-                queue->rec = nu->rec;
-                show_queue(id, queue->rec, "queue_rec is updated, queue_count=%d, chunk_count=%d, block_count=%d", queue->count, chunk->count, block->count);
-            } else {
-                queue->rec = NULL;
-                show_queue(id, record, "queue_rec is empty, queue_count=%d, chunk_count=%d, block_count=%d", queue->count, chunk->count, block->count);
-            }
-        }
-        queue_del_item(block);
-        queue_del_item(chunk);
+    if (!parent) {
+        assert(node == queue->root);
+        pool_free(POOL_QUEUE, node);
+        queue->root = NULL;
+        queue->tail = NULL;
+        queue->height = 0;
+        return;
     }
+    while (!queue->root->leaf && (queue->root->count == 1)) {
+        node = queue->root;
+        queue->root = node->children[0];
+        queue->root->parent = NULL;
+        queue->height--;
+        pool_free(POOL_QUEUE, node);
+    }
+    for (node = queue->root; !node->leaf; node = node->children[node->count - 1]);
+    queue->tail = node;
 }
 
 
-static inline void queue_remove_item(int id, queue_item_t *block, record_t *record)
-{
-    show_queue(id, record, "block_count=%d (block=0x%llx)", block->count, (unsigned long long)block);
-    assert(block->count > 1);
-    queue_rbtree_remove(&block->root, &record->item_node[id]);
-    queue_remove_list(&record->item_list[id]);
-    queue_item_counter_dec(block);
-}
-
-
-static inline void queue_remove(int id, record_t *record)
+static inline void queue_remove(int id, queue_t *queue, record_t *record)
 {
-    queue_item_t *block = record->block[id];
-
-    if (block->rec == record)
-        queue_remove_block_item(id, block, record);
+    queue_node_t *leaf = record->links[id].leaf;
+    int i = queue_leaf_index(leaf, record);
+    int n = leaf->count - i - 1;
+    timestamp_t removed = leaf->keys[i];
+
+    show_queue(id, record, "leaf_count=%d (leaf=0x%llx)", leaf->count, (unsigned long long)leaf);
+    memmove(&leaf->keys[i], &leaf->keys[i + 1], n * sizeof(timestamp_t));
+    memmove(&leaf->records[i], &leaf->records[i + 1], n * sizeof(record_t *));
+    leaf->count--;
+    record->links[id].leaf = NULL;
+    if (!leaf->count)
+        queue_del_node(queue, leaf);
     else
-        queue_remove_item(id, block, record);
-    record->block[id] = NULL;
+        queue_update_keys(leaf, &removed);
 }
 
 
 void queue_pop(int id, record_t *record)
 {
-    queue_item_t *queue = &queue_status.queues[id];
+    queue_t *queue = &queue_status.queues[id];
 
     if (queue->length > 0) {
-        queue_remove(id, record);
+        queue_remove(id, queue, record);
         queue->length--;
         show_queue(id, record, "len=%d seq=%d (id=%d)", queue->length, queue->seq, id);
     } else
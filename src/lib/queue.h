@@ -2,58 +2,38 @@
 #define _QUEUE_H
 
 #include "list.h"
-#include "rbtree.h"
 #include "record.h"
 
-#define QUEUE_ENTRY_MAX 32
-#define QUEUE_BLOCK_MAX 32
-#define QUEUE_CHUNK_MAX 4096
+#define QUEUE_FANOUT    32
 #define QUEUE_LENGTH    10000000
 
-typedef struct queue_item {
-    seq_t seq;
+/*
+ * A B+tree kept in arrival order. Records are only appended at the
+ * rightmost leaf, and every slot of an inner node carries the minimum
+ * timestamp of its subtree, so finding the latest record earlier than
+ * a given timestamp descends a single path.
+ */
+typedef struct queue_node {
     int count;
+    bool leaf;
+    struct queue_node *parent;
+    timestamp_t keys[QUEUE_FANOUT];
+    union {
+        record_t *records[QUEUE_FANOUT];
+        struct queue_node *children[QUEUE_FANOUT];
+    };
+} queue_node_t;
+
+typedef struct queue {
+    seq_t seq;
     int length;
-    rbtree_t root;
-    record_t *rec;
-    rbtree_node_t node;
+    int height;
+    queue_node_t *root;
+    queue_node_t *tail;
     struct list_head list;
-    struct list_head head;
-    struct queue_item *parent;
-} queue_item_t;
-
-#define queue_remove_list(l) do { \
-    assert(is_valid(l)); \
-    list_del(l); \
-    set_empty(l); \
-} while (0)
-
-#define queue_rbtree_insert(p_root, p_key, p_node) do { \
-    assert(p_key); \
-    if (rb_tree_insert(p_root, p_key, p_node)) { \
-        show_timestamp("Error:", -1, p_key); \
-        log_err("failed to insert"); \
-    } \
-    assert((p_root)->root); \
-} while (0)
-
-#define queue_rbtree_rightmost(p_root, p_node) do { \
-    assert((p_root)->root); \
-    if (rb_tree_get_rightmost(p_root, p_node)) \
-        log_err("failed to get rightmost"); \
-} while (0)
-
-#define queue_rbtree_remove(p_root, p_node) do { \
-    assert((p_root)->root); \
-    rb_tree_remove(p_root, p_node); \
-} while (0)
+} queue_t;
 
-#define queue_item_counter_dec(item) do { \
-    assert((item)->count > 0); \
-    (item)->count--; \
-    if ((item)->count > 0) \
-        assert((item)->root.root); \
-} while (0)
+#define queue_is_member(id, rec) ((rec)->links[id].leaf != NULL)
 
 void queue_init();
 int queue_length(int id);
@@ -0,0 +1,69 @@
+#include "ref.h"
+#include "util.h"
+
+// A ref_msg_t owns a message and lets several sockets send its frames without
+// copying them. Every frame handed to zmq holds a reference, which is dropped
+// by zmq once the frame has been sent.
+ref_msg_t *ref_new(zmsg_t *msg)
+{
+    zframe_t *frame;
+    ref_msg_t *ref = malloc(sizeof(ref_msg_t));
+
+    if (!ref) {
+        log_err("no memory");
+        return NULL;
+    }
+    ref->count = 1;
+    ref->msg = msg;
+    ref->nr_frames = 0;
+    for (frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        assert(ref->nr_frames < REF_FRAME_MAX);
+        ref->frames[ref->nr_frames++] = frame;
+    }
+    return ref;
+}
+
+
+ref_msg_t *ref_get(ref_msg_t *ref)
+{
+    __sync_fetch_and_add(&ref->count, 1);
+    return ref;
+}
+
+
+void ref_put(ref_msg_t *ref)
+{
+    if (ref && (__sync_sub_and_fetch(&ref->count, 1) == 0)) {
+        zmsg_destroy(&ref->msg);
+        free(ref);
+    }
+}
+
+
+static void ref_free(void *data, void *hint)
+{
+    ref_put((ref_msg_t *)hint);
+}
+
+
+int ref_send(ref_msg_t *ref, void *socket)
+{
+    for (int i = 0; i < ref->nr_frames; i++) {
+        zmq_msg_t msg;
+        zframe_t *frame = ref->frames[i];
+        int flags = (i < ref->nr_frames - 1) ? ZMQ_SNDMORE : 0;
+
+        ref_get(ref);
+        zmq_msg_init_data(&msg, zframe_data(frame), zframe_size(frame), ref_free, ref);
+        while (zmq_msg_send(&msg, socket, flags) < 0) {
+            if (errno == EINTR)
+                continue;
+            zmq_msg_close(&msg);
+            // the socket would be left in the middle of a message after the first frame
+            if (i > 0)
+                log_err("failed to send, frame=%d", i);
+            return -EIO;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _REF_H
+#define _REF_H
+
+#include <tbc.h>
+
+#define REF_FRAME_MAX 8
+
+typedef struct ref_msg {
+    int count;
+    zmsg_t *msg;
+    int nr_frames;
+    zframe_t *frames[REF_FRAME_MAX];
+} ref_msg_t;
+
+void ref_put(ref_msg_t *ref);
+ref_msg_t *ref_new(zmsg_t *msg);
+ref_msg_t *ref_get(ref_msg_t *ref);
+int ref_send(ref_msg_t *ref, void *socket);
+
+#endif
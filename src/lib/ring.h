@@ -0,0 +1,81 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdbool.h>
+
+#define RING_SIZE       4096 // must be a power of 2
+#define RING_LINE_SIZE  64
+
+/*
+ * Single-producer single-consumer ring. Each side caches the index of
+ * the other one and only reloads it when the ring looks full (or empty),
+ * so head and tail stay on their own cache lines most of the time.
+ */
+typedef struct ring {
+    unsigned long head __attribute__((aligned(RING_LINE_SIZE)));
+    unsigned long tail_cache;
+    unsigned long tail __attribute__((aligned(RING_LINE_SIZE)));
+    unsigned long head_cache;
+    void *slots[RING_SIZE] __attribute__((aligned(RING_LINE_SIZE)));
+} ring_t;
+
+static inline void ring_init(ring_t *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    ring->tail_cache = 0;
+    ring->head_cache = 0;
+}
+
+
+// Free slots seen by the producer
+static inline unsigned long ring_space(ring_t *ring)
+{
+    unsigned long tail = ring->tail;
+
+    if (tail - ring->head_cache == RING_SIZE)
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return RING_SIZE - (tail - ring->head_cache);
+}
+
+
+static inline bool ring_push(ring_t *ring, void *ptr)
+{
+    unsigned long tail = ring->tail;
+
+    if (tail - ring->head_cache == RING_SIZE) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache == RING_SIZE)
+            return false;
+    }
+    ring->slots[tail & (RING_SIZE - 1)] = ptr;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+static inline void *ring_pop(ring_t *ring)
+{
+    void *ptr;
+    unsigned long head = ring->head;
+
+    if (head == ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->tail_cache)
+            return NULL;
+    }
+    ptr = ring->slots[head & (RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return ptr;
+}
+
+
+// Approximate when called from neither side
+static inline unsigned long ring_depth(ring_t *ring)
+{
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+#endif
@@ -0,0 +1,347 @@
+#include <unistd.h>
+#include <pthread.h>
+#include "timer.h"
+#include "log.h"
+#include "ev.h"
+
+#ifdef LINUX
+#include <sys/timerfd.h>
+#endif
+
+#define timer_lock() pthread_mutex_lock(&timer_status.lock)
+#define timer_unlock() pthread_mutex_unlock(&timer_status.lock)
+
+#define timer_tick(nsec) ((nsec) / TIMER_TICK)
+#define timer_shift(level) ((level) * TIMER_SLOT_BITS)
+#define timer_span(level) (1ULL << timer_shift((level) + 1))
+#define timer_index(tick, level) ((int)(((tick) >> timer_shift(level)) & (TIMER_SLOTS - 1)))
+
+struct {
+    uint64_t clock; // the tick being processed
+    uint64_t next;  // nsec, the time the wheel is armed for, 0 if disarmed
+    uint64_t bitmap[TIMER_LEVELS];
+    struct list_head slots[TIMER_LEVELS][TIMER_SLOTS];
+    pthread_mutex_t lock;
+#ifdef LINUX
+    int fd;
+#else
+    ev_t ev;
+#endif
+} timer_status;
+
+static inline uint64_t timer_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * (uint64_t)EV_SEC + t.tv_nsec;
+}
+
+
+// A task lands on the lowest level whose span covers its expiry. Tasks
+// beyond the whole wheel wait in its farthest slot and are placed again
+// when that slot cascades.
+static void timer_place(timer_task_t *task)
+{
+    int level;
+    uint64_t clock = timer_status.clock;
+    uint64_t tick = timer_tick(task->expire);
+
+    if (tick < clock)
+        tick = clock;
+    for (level = 0; level < TIMER_LEVELS - 1; level++)
+        if (tick - clock < timer_span(level))
+            break;
+    if (tick - clock >= timer_span(level))
+        tick = clock + timer_span(level) - 1;
+    task->level = level;
+    task->slot = timer_index(tick, level);
+    list_add_tail(&task->list, &timer_status.slots[level][task->slot]);
+    timer_status.bitmap[level] |= 1ULL << task->slot;
+}
+
+
+static inline void timer_unlink(timer_task_t *task)
+{
+    struct list_head *head = &timer_status.slots[task->level][task->slot];
+
+    list_del(&task->list);
+    if (list_empty(head))
+        timer_status.bitmap[task->level] &= ~(1ULL << task->slot);
+}
+
+
+// The clock has just crossed a boundary of level 0, move the tasks of the
+// slots it reached on the upper levels down the wheel.
+static void timer_cascade()
+{
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        int slot = timer_index(timer_status.clock, level);
+        struct list_head *head = &timer_status.slots[level][slot];
+
+        if (timer_status.bitmap[level] & (1ULL << slot)) {
+            timer_task_t *task;
+            timer_task_t *next;
+            struct list_head list;
+
+            INIT_LIST_HEAD(&list);
+            list_splice(head, &list);
+            INIT_LIST_HEAD(head);
+            timer_status.bitmap[level] &= ~(1ULL << slot);
+            list_for_each_entry_safe(task, next, &list, list)
+                timer_place(task);
+        }
+        if (slot)
+            break;
+    }
+}
+
+
+// Move the clock to the next slot of level 0 that holds tasks, stopping at
+// the boundary of level 0 (to cascade) and at the given tick.
+static void timer_forward(uint64_t tick)
+{
+    uint64_t next;
+    uint64_t clock = timer_status.clock;
+    int index = timer_index(clock, 0);
+    uint64_t bits = index < TIMER_SLOTS - 1 ? timer_status.bitmap[0] & (~0ULL << (index + 1)) : 0;
+    bool idle = true;
+
+    for (int level = 0; level < TIMER_LEVELS; level++)
+        if (timer_status.bitmap[level])
+            idle = false;
+    if (idle) {
+        timer_status.clock = tick;
+        return;
+    }
+    if (bits)
+        next = clock - index + __builtin_ctzll(bits);
+    else
+        next = (clock | (TIMER_SLOTS - 1)) + 1;
+    timer_status.clock = next < tick ? next : tick;
+    if (!timer_index(timer_status.clock, 0))
+        timer_cascade();
+}
+
+
+static timer_task_t *timer_expired(uint64_t now)
+{
+    uint64_t tick = timer_tick(now);
+
+    while (true) {
+        timer_task_t *task;
+        struct list_head *head = &timer_status.slots[0][timer_index(timer_status.clock, 0)];
+
+        list_for_each_entry(task, head, list)
+            if (task->expire <= now)
+                return task;
+        if (timer_status.clock >= tick)
+            return NULL;
+        timer_forward(tick);
+    }
+}
+
+
+static inline uint64_t timer_slot_min(struct list_head *head)
+{
+    uint64_t min = (uint64_t)-1;
+    timer_task_t *task;
+
+    list_for_each_entry(task, head, list)
+        if (task->expire < min)
+            min = task->expire;
+    return min;
+}
+
+
+// The earliest time the wheel has to act, which is either the expiry of
+// a task on level 0 or the cascade of an upper slot.
+static uint64_t timer_next()
+{
+    uint64_t next = 0;
+    uint64_t clock = timer_status.clock;
+    uint64_t bits = timer_status.bitmap[0];
+
+    if (bits) {
+        uint64_t ahead = bits & (~0ULL << timer_index(clock, 0));
+
+        if (ahead)
+            return timer_slot_min(&timer_status.slots[0][__builtin_ctzll(ahead)]);
+        next = timer_slot_min(&timer_status.slots[0][__builtin_ctzll(bits)]);
+    }
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        int index = timer_index(clock, level);
+        uint64_t base = clock & ~(timer_span(level) - 1);
+        uint64_t tick;
+
+        bits = timer_status.bitmap[level];
+        if (!bits)
+            continue;
+        if ((index < TIMER_SLOTS - 1) && (bits & (~0ULL << (index + 1))))
+            tick = base + ((uint64_t)__builtin_ctzll(bits & (~0ULL << (index + 1))) << timer_shift(level));
+        else
+            tick = base + timer_span(level) + ((uint64_t)__builtin_ctzll(bits) << timer_shift(level));
+        if (!next || (tick * TIMER_TICK < next))
+            next = tick * TIMER_TICK;
+    }
+    return next;
+}
+
+
+static void timer_arm(uint64_t next)
+{
+#ifdef LINUX
+    struct itimerspec t;
+
+    memset(&t, 0, sizeof(struct itimerspec));
+    t.it_value.tv_sec = next / EV_SEC;
+    t.it_value.tv_nsec = next % EV_SEC;
+    if (timerfd_settime(timer_status.fd, TFD_TIMER_ABSTIME, &t, NULL))
+        log_err("failed to arm timer");
+#endif
+    timer_status.next = next;
+}
+
+
+static void timer_wait()
+{
+#ifdef LINUX
+    uint64_t n;
+
+    if ((read(timer_status.fd, &n, sizeof(uint64_t)) < 0) && (errno != EINTR))
+        log_err("failed to read timer");
+#else
+    uint64_t next = timer_status.next;
+
+    if (next) {
+        uint64_t now = timer_now();
+
+        ev_timedwait(&timer_status.ev, next > now ? next - now : 0);
+    } else
+        ev_wait(&timer_status.ev);
+#endif
+}
+
+
+void *timer_handler(void *arg)
+{
+    while (true) {
+        timer_task_t *task;
+        uint64_t now = timer_now();
+
+        timer_lock();
+        while ((task = timer_expired(now))) {
+            void *arg = task->arg;
+            timer_func_t func = task->func;
+
+            timer_unlink(task);
+            if (task->period) {
+                task->expire += task->period;
+                if (task->expire <= now)
+                    task->expire = now + task->period;
+                timer_place(task);
+            } else
+                task->active = false;
+            timer_unlock();
+            func(arg);
+            timer_lock();
+            now = timer_now();
+        }
+        timer_arm(timer_next());
+        timer_unlock();
+        timer_wait();
+    }
+    return NULL;
+}
+
+
+// Arms a task to fire after the given timeout (nsec), and then every
+// period if it has one. A task that is already armed is moved.
+void timer_start(timer_task_t *task, timeout_t timeout)
+{
+    timer_lock();
+    if (task->active)
+        timer_unlink(task);
+    task->expire = timer_now() + timeout;
+    task->active = true;
+    timer_place(task);
+    if (!timer_status.next || (task->expire < timer_status.next)) {
+        timer_arm(task->expire);
+#ifndef LINUX
+        ev_set(&timer_status.ev);
+#endif
+    }
+    timer_unlock();
+}
+
+
+void timer_stop(timer_task_t *task)
+{
+    timer_lock();
+    if (task->active) {
+        timer_unlink(task);
+        task->active = false;
+    }
+    timer_unlock();
+}
+
+
+timer_task_t *timer_new(timer_func_t func, void *arg, timeout_t period)
+{
+    timer_task_t *task = malloc(sizeof(timer_task_t));
+
+    if (!task) {
+        log_err("no memory");
+        return NULL;
+    }
+    memset(task, 0, sizeof(timer_task_t));
+    task->func = func;
+    task->arg = arg;
+    task->period = period;
+    return task;
+}
+
+
+// Registers a periodic task, which first fires after one period
+timer_task_t *timer_add(timer_func_t func, void *arg, timeout_t period)
+{
+    timer_task_t *task = timer_new(func, arg, period);
+
+    assert(period > 0);
+    timer_start(task, period);
+    return task;
+}
+
+
+void timer_create_handler()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, timer_handler, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+
+void timer_init()
+{
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        for (int j = 0; j < TIMER_SLOTS; j++)
+            INIT_LIST_HEAD(&timer_status.slots[i][j]);
+        timer_status.bitmap[i] = 0;
+    }
+    timer_status.next = 0;
+    timer_status.clock = timer_tick(timer_now());
+    pthread_mutex_init(&timer_status.lock, NULL);
+#ifdef LINUX
+    timer_status.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_status.fd < 0)
+        log_err("failed to create timer");
+#else
+    ev_init(&timer_status.ev, EV_NOTIMEOUT);
+#endif
+    timer_create_handler();
+}
@@ -0,0 +1,36 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <tbc.h>
+#include "list.h"
+
+#define TIMER_TICK        1000000 // nsec
+#define TIMER_LEVELS      4
+#define TIMER_SLOT_BITS   6
+#define TIMER_SLOTS       (1 << TIMER_SLOT_BITS)
+
+typedef void (*timer_func_t)(void *arg);
+
+/*
+ * A task sits in a slot of the wheel until it expires. The wheel only
+ * buckets tasks by tick, the timerfd is armed to the exact expiry of the
+ * earliest one, so a task never fires early and an idle wheel never wakes.
+ */
+typedef struct timer_task {
+    int level;
+    int slot;
+    bool active;
+    uint64_t expire;  // nsec, CLOCK_MONOTONIC
+    timeout_t period; // nsec, 0 for a one-shot task
+    timer_func_t func;
+    void *arg;
+    struct list_head list;
+} timer_task_t;
+
+void timer_init();
+void timer_stop(timer_task_t *task);
+void timer_start(timer_task_t *task, timeout_t timeout);
+timer_task_t *timer_new(timer_func_t func, void *arg, timeout_t period);
+timer_task_t *timer_add(timer_func_t func, void *arg, timeout_t period);
+
+#endif
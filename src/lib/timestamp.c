@@ -1,34 +1,38 @@
 #include "timestamp.h"
 #include "util.h"
-
-#define NR_TS_GROUPS 1024
-
-#define ts_tree_create rb_tree_new
-#define ts_node_lookup rb_tree_find
-#define ts_node_insert rb_tree_insert
-#define ts_lock_init pthread_rwlock_init
-#define ts_hash(timestamp) (timestamp->hid % NR_TS_GROUPS)
-#define ts_group_wrlock(grp) pthread_rwlock_wrlock(&(grp)->lock)
-#define ts_group_rdlock(grp) pthread_rwlock_rdlock(&(grp)->lock)
-#define ts_group_unlock(grp) pthread_rwlock_unlock(&(grp)->lock)
-#define ts_group(timestamp) (&timestamp_status.ts_groups[ts_hash(timestamp)])
-
-typedef rbtree_t ts_tree_t;
-typedef rbtree_node_t ts_node_t;
-typedef pthread_rwlock_t ts_lock_t;
-
+#include "timer.h"
+
+#define TIMESTAMP_TTL        3600          // sec
+#define TIMESTAMP_GC_INTV    1000000000    // nsec
+#define TIMESTAMP_TABLE_BITS 16
+#define TIMESTAMP_TABLE_SIZE (1 << TIMESTAMP_TABLE_BITS) // slots
+
+#define TIMESTAMP_EMPTY      0
+#define TIMESTAMP_USED       ((uint64_t)1 << 63)
+#define TIMESTAMP_TOMBSTONE  ((uint64_t)-1)
+#define TIMESTAMP_DEAD       ((uint64_t)-1)
+
+#define timestamp_key(hid) ((uint64_t)(hid) | TIMESTAMP_USED)
+#define timestamp_pack(timestamp) (((uint64_t)(timestamp)->sec << 32) | (timestamp)->usec)
+#define timestamp_hash(hid) hid_hash(hid, TIMESTAMP_TABLE_BITS)
+#define timestamp_lock() pthread_mutex_lock(&timestamp_status.lock)
+#define timestamp_unlock() pthread_mutex_unlock(&timestamp_status.lock)
+
+// A slot maps the hid of a client to its latest delivered timestamp.
+// Slots are claimed and reclaimed under the table lock, while lookups
+// and updates of the packed timestamp are lock-free. The key of a claimed
+// slot is its hid with TIMESTAMP_USED (never set in a hid, see index2hid),
+// so that every hid is valid.
 typedef struct {
-    ts_tree_t tree;
-    ts_lock_t lock;
-} ts_group_t;
-
-typedef struct {
-    ts_node_t node;
-    timestamp_t timestamp;
-} ts_t;
+    uint64_t key;
+    uint32_t touch;
+    uint64_t value;
+} ts_slot_t;
 
 struct {
-    ts_group_t ts_groups[NR_TS_GROUPS];
+    uint32_t now;
+    pthread_mutex_t lock;
+    ts_slot_t slots[TIMESTAMP_TABLE_SIZE];
 } timestamp_status;
 
 int timestamp_compare(const void *t1, const void *t2)
@@ -61,90 +65,137 @@ int timestamp_compare(const void *t1, const void *t2)
 }
 
 
-int timestamp_node_compare(const void *t1, const void *t2)
+static inline ts_slot_t *timestamp_lookup(hid_t hid)
 {
-    timestamp_t *ts1 = (timestamp_t *)(t1);
-    timestamp_t *ts2 = (timestamp_t *)(t2);
-    hid_t hid1 = ts1->hid;
-    hid_t hid2 = ts2->hid;
+    uint64_t key = timestamp_key(hid);
+    uint32_t n = timestamp_hash(hid);
+
+    for (int i = 0; i < TIMESTAMP_TABLE_SIZE; i++) {
+        ts_slot_t *slot = &timestamp_status.slots[n];
+        uint64_t curr = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (curr == key)
+            return slot;
+        else if (curr == TIMESTAMP_EMPTY)
+            break;
+        n = (n + 1) & (TIMESTAMP_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
 
-    return hid1 == hid2 ? 0 : (hid1 > hid2 ? 1 : -1);
+
+static inline ts_slot_t *timestamp_add(hid_t hid)
+{
+    ts_slot_t *slot = NULL;
+    ts_slot_t *avail = NULL;
+    uint64_t key = timestamp_key(hid);
+    uint32_t n = timestamp_hash(hid);
+
+    timestamp_lock();
+    for (int i = 0; i < TIMESTAMP_TABLE_SIZE; i++) {
+        ts_slot_t *curr = &timestamp_status.slots[n];
+
+        if (curr->key == key) {
+            slot = curr;
+            goto out;
+        } else if (curr->key == TIMESTAMP_TOMBSTONE) {
+            if (!avail)
+                avail = curr;
+        } else if (curr->key == TIMESTAMP_EMPTY) {
+            if (!avail)
+                avail = curr;
+            break;
+        }
+        n = (n + 1) & (TIMESTAMP_TABLE_SIZE - 1);
+    }
+    if (!avail) {
+        log_err("no space");
+        goto out;
+    }
+    slot = avail;
+    slot->value = 0;
+    slot->touch = timestamp_status.now;
+    __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+out:
+    timestamp_unlock();
+    return slot;
 }
 
 
-inline void timestamp_add(ts_group_t *grp, timestamp_t *timestamp)
+bool timestamp_update(timestamp_t *timestamp)
 {
-    ts_t *ts = calloc(1, sizeof(ts_t));
+    ts_slot_t *slot;
+    uint64_t value = timestamp_pack(timestamp);
+
+    while (true) {
+        uint64_t curr;
 
-    ts->timestamp = *timestamp;
-    if (ts_node_insert(&grp->tree, &ts->timestamp, &ts->node)) {
-        log_err("failed to add");
-        assert(0);
+        slot = timestamp_lookup(timestamp->hid);
+        if (!slot) {
+            slot = timestamp_add(timestamp->hid);
+            if (!slot)
+                return true;
+        }
+        curr = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+
+        while ((curr != TIMESTAMP_DEAD) && (curr < value)) {
+            if (__atomic_compare_exchange_n(&slot->value, &curr, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                slot->touch = timestamp_status.now;
+                return true;
+            }
+        }
+        if (curr != TIMESTAMP_DEAD)
+            break;
+        // the slot has been collected, so claim a new one
     }
+    show_timestamp("***  expired  ***", -1, timestamp);
+    return false;
 }
 
 
-inline ts_t *timestamp_lookup(ts_group_t *grp, timestamp_t *timestamp)
+bool timestamp_check(timestamp_t *timestamp)
 {
-    ts_node_t *node = NULL;
+    uint64_t curr;
+    ts_slot_t *slot = timestamp_lookup(timestamp->hid);
 
-    if (!ts_node_lookup(&grp->tree, timestamp, &node))
-        return tree_entry(node, ts_t, node);
-    else
-        return NULL;
+    if (!slot)
+        return true;
+    curr = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+    return (curr == TIMESTAMP_DEAD) || (curr < timestamp_pack(timestamp));
 }
 
 
-bool timestamp_update(timestamp_t *timestamp)
+static void timestamp_collect()
 {
-    ts_t *ts;
-    bool ret = true;
-    ts_group_t *grp = ts_group(timestamp);
-
-    ts_group_wrlock(grp);
-    ts = timestamp_lookup(grp, timestamp);
-    if (!ts)
-        timestamp_add(grp, timestamp);
-    else {
-        if (timestamp_compare(&ts->timestamp, timestamp) < 0)
-            ts->timestamp = *timestamp;
-        else {
-            show_timestamp("***  expired  ***", -1, timestamp);
-            ret = false;
+    uint32_t now = timestamp_status.now;
+
+    timestamp_lock();
+    for (int i = 0; i < TIMESTAMP_TABLE_SIZE; i++) {
+        ts_slot_t *slot = &timestamp_status.slots[i];
+        uint64_t key = slot->key;
+
+        if ((key != TIMESTAMP_EMPTY) && (key != TIMESTAMP_TOMBSTONE) && (now - slot->touch > TIMESTAMP_TTL)) {
+            uint64_t curr = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+
+            if ((curr != TIMESTAMP_DEAD) && __atomic_compare_exchange_n(&slot->value, &curr, TIMESTAMP_DEAD, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                __atomic_store_n(&slot->key, TIMESTAMP_TOMBSTONE, __ATOMIC_RELEASE);
         }
     }
-out:
-    ts_group_unlock(grp);
-    return ret;
+    timestamp_unlock();
 }
 
 
-bool timestamp_check(timestamp_t *timestamp)
+void timestamp_collector(void *arg)
 {
-    bool ret;
-    ts_t *ts;
-    ts_group_t *grp = ts_group(timestamp);
-
-    ts_group_rdlock(grp);
-    ts = timestamp_lookup(grp, timestamp);
-    if (!ts)
-        ret = true;
-    else {
-        if (timestamp_compare(&ts->timestamp, timestamp) < 0)
-            ret = true;
-        else
-            ret = false;
-    }
-    ts_group_unlock(grp);
-    return ret;
+    timestamp_status.now = time(NULL);
+    timestamp_collect();
 }
 
 
 void timestamp_init()
 {
-    for (int i = 0; i < NR_TS_GROUPS; i++) {
-        if (ts_tree_create(&timestamp_status.ts_groups[i].tree, timestamp_node_compare))
-            log_err("failed to create");
-        ts_lock_init(&timestamp_status.ts_groups[i].lock, NULL);
-    }
+    memset(timestamp_status.slots, 0, sizeof(timestamp_status.slots));
+    pthread_mutex_init(&timestamp_status.lock, NULL);
+    timestamp_status.now = time(NULL);
+    timer_add(timestamp_collector, NULL, TIMESTAMP_GC_INTV);
 }
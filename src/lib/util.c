@@ -1,5 +1,9 @@
 #include "util.h"
+#include "ref.h"
+#include "outbox.h"
+#include "wire.h"
 #include "ev.h"
+#include "timer.h"
 
 #define FUNC_TIMER_MAX 32
 const timeout_t FUNC_TIMEOUT_ERROR   = 10 * (timeout_t)EV_SEC;
@@ -8,9 +12,8 @@ const timeout_t FUNC_TIMEOUT_WARNING = 5000000;      // usec
 typedef struct {
     bool enter;
     timeval_t t;
-    ev_t ev_wakeup;
-    ev_t ev_timeout;
     char *func_name;
+    timer_task_t *timer;
     struct list_head list;
 } func_timer_t;
 
@@ -45,25 +48,52 @@ void addr_convert(const char *protocol, char *dest, char *src, int port)
 }
 
 
-void publish(sender_desc_t *sender, zmsg_t *msg)
+// Client requests, either a message (timestamp and body) or a frame of
+// coalesced requests, can be dropped by an outbox as the peer gets them
+// again on request. Batch, NACK and RETX frames cannot.
+static inline bool is_droppable(ref_msg_t *ref)
 {
-    int i;
+    zframe_t *frame = ref->frames[0];
 
-    for (i = 0; i < sender->total - 1; i++) {
-        zmsg_t *dup = zmsg_dup(msg);
+    if (ref->nr_frames > 1)
+        return true;
+    return wire_kind((char *)zframe_data(frame), zframe_size(frame)) == WIRE_REQUESTS;
+}
 
-        sndmsg(&dup, sender->desc[i]);
+
+void publish_ref(sender_desc_t *sender, ref_msg_t *ref)
+{
+    bool droppable = is_droppable(ref);
+
+    for (int i = 0; i < sender->total; i++) {
+        if (sender->outbox[i])
+            outbox_push(sender->outbox[i], ref, droppable);
+        else
+            ref_send(ref, sender->desc[i]);
     }
+}
 
-    sndmsg(&msg, sender->desc[i]);
+
+void publish(sender_desc_t *sender, zmsg_t *msg)
+{
+    if ((sender->total > 1) || sender->outbox[0]) {
+        ref_msg_t *ref = ref_new(msg);
+
+        publish_ref(sender, ref);
+        ref_put(ref);
+    } else
+        sndmsg(&msg, sender->desc[0]);
 }
 
 
+// A callback is called with NULL when the receive times out
 void forward(void *src, void *dest, callback_t callback, sender_desc_t *sender)
 {
     while (true) {
         zmsg_t *msg = zmsg_recv(src);
 
+        if (!msg && !callback)
+            continue;
         if (callback)
             msg = callback(msg);
 
@@ -128,27 +158,16 @@ void func_timer_unlock()
 }
 
 
-void *func_timer(void *arg)
+void func_timer_expire(void *arg)
 {
     func_timer_t *timer = (func_timer_t *)arg;
 
-    while (true) {
-        int ret;
-
-        ev_wait(&timer->ev_wakeup);
-        ret = ev_wait(&timer->ev_timeout);
-        if (ETIMEDOUT == ret)
-            log_info("[%s] timeout", timer->func_name);
-    }
-
-    return NULL;
+    log_info("[%s] timeout", timer->func_name);
 }
 
 
 func_timer_t *func_timer_create(const char *func_name)
 {
-    pthread_t thread;
-    pthread_attr_t attr;
     func_timer_t *timer = NULL;
 
     assert(func_timer_status.total < FUNC_TIMER_MAX);
@@ -157,16 +176,8 @@ func_timer_t *func_timer_create(const char *func_name)
     timer = malloc(sizeof(func_timer_t));
     timer->enter = false;
     timer->func_name = (char *)func_name;
-    ev_init(&timer->ev_wakeup, EV_NOTIMEOUT);
-    ev_init(&timer->ev_timeout, FUNC_TIMEOUT_ERROR);
+    timer->timer = timer_new(func_timer_expire, timer, 0);
     list_add_tail(&timer->list, &func_timer_status.head);
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-    pthread_create(&thread, &attr, func_timer, timer);
-    pthread_attr_destroy(&attr);
-
     return timer;
 }
 
@@ -192,7 +203,7 @@ void func_timer_start(const char *func_name)
     if (!ent->enter) {
         ent->enter = true;
         get_time(ent->t);
-        ev_set(&ent->ev_wakeup);
+        timer_start(ent->timer, FUNC_TIMEOUT_ERROR);
     }
     func_timer_unlock();
 }
@@ -215,7 +226,7 @@ void func_timer_stop(const char *func_name)
     }
     assert(match);
     if (ent->enter) {
-        ev_set(&ent->ev_timeout);
+        timer_stop(ent->timer);
         ent->enter = false;
         get_time(current);
         t = time_diff(&ent->t, &current);
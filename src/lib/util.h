@@ -20,6 +20,12 @@
 
 #define get_time(t) gettimeofday(&(t), NULL)
 #define addr2hid(addr) ((hid_t)(addr).s_addr)
+// The hid of client index i holds the host address in its low 32 bits and i
+// in the next 16, so the hids of distinct hosts never collide, and the top
+// 16 bits of a hid are always clear.
+#define index2hid(addr, index) (addr2hid(addr) | ((hid_t)(index) << 32))
+#define HID_INDEX_MAX 65535
+#define hid_hash(hid, bits) ((uint32_t)(((uint64_t)(hid) * 11400714819323198485ULL) >> (64 - (bits))))
 #define get_timestamp(msg) ((timestamp_t *)zframe_data(zmsg_first(msg)))
 
 #define pgmaddr(addr, orig, port) addr_convert("pgm", addr, orig, port)
@@ -31,6 +37,9 @@
 #define is_valid(list) ((list)->next != NULL)
 #define set_empty(list) do { (list)->next = NULL; } while (0)
 
+struct outbox;
+struct ref_msg;
+
 typedef void (*sender_t)(zmsg_t *);
 typedef zmsg_t *(*callback_t)(zmsg_t *);
 
@@ -38,6 +47,7 @@ typedef struct sender_desc {
     int total;
     sender_t sender;
     void *desc[NODE_MAX];
+    struct outbox *outbox[NODE_MAX];
 } sender_desc_t;
 
 typedef struct {
@@ -71,6 +81,7 @@ void init_func_timer();
 struct in_addr get_addr();
 int get_bits(uint64_t val);
 void publish(sender_desc_t *sender, zmsg_t *msg);
+void publish_ref(sender_desc_t *sender, struct ref_msg *ref);
 uint64_t time_diff(timeval_t *start, timeval_t *end);
 void addr_convert(const char *protocol, char *dest, char *src, int port);
 void forward(void *frontend, void *backend, callback_t callback, sender_desc_t *sender);
@@ -2,6 +2,7 @@
 #define VERIFY_H
 
 #include "util.h"
+#include "rbtree.h"
 
 typedef struct {
     uint64_t hid;
@@ -0,0 +1,375 @@
+#include "wire.h"
+#include "util.h"
+#include "ref.h"
+
+#define wire_zigzag(n) (((uint32_t)(n) << 1) ^ (uint32_t)((n) >> 31))
+#define wire_unzigzag(n) ((int32_t)(((n) >> 1) ^ -((n) & 1)))
+
+// Layout of a frame (all integers are LEB128 varints):
+//   version (1 byte) | kind (1 byte) | session | count
+//   dep:        every cell if kind has WIRE_FULL, otherwise nr_changed, (cell, value) ...
+//   timestamps: sec_base, then zigzag(sec - sec_base), zigzag(usec - prev_usec),
+//               ntohl(addr) ^ ntohl(prev_addr), index ^ prev_index for each
+//               entry, where addr and index are the two halves of the hid
+// A NACK frame is version | WIRE_NACK | target | count | timestamps, and a
+// RETX frame is version | WIRE_RETX | target | count, then nr_frames and
+// (size, bytes) of each frame for every message. A REQUESTS frame is
+// version | WIRE_REQUESTS | count, followed by messages encoded as in RETX.
+static inline char *wire_put(char *p, uint32_t n)
+{
+    while (n >= 0x80) {
+        *p++ = (char)(n | 0x80);
+        n >>= 7;
+    }
+    *p++ = (char)n;
+    return p;
+}
+
+
+static inline char *wire_get(char *p, char *end, uint32_t *n)
+{
+    uint32_t val = 0;
+
+    for (int shift = 0; (p < end) && (shift < 7 * WIRE_VARINT_MAX); shift += 7) {
+        uint8_t byte = (uint8_t)*p++;
+
+        val |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *n = val;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+static inline char *wire_put_timestamps(char *p, timestamp_t *timestamps, int count)
+{
+    uint32_t usec = 0;
+    uint32_t addr = 0;
+    uint32_t index = 0;
+
+    if (!count)
+        return p;
+    p = wire_put(p, timestamps[0].sec);
+    for (int i = 0; i < count; i++) {
+        timestamp_t *t = &timestamps[i];
+        int32_t sec = (int32_t)(t->sec - timestamps[0].sec);
+        int32_t delta = (int32_t)(t->usec - usec);
+
+        p = wire_put(p, wire_zigzag(sec));
+        p = wire_put(p, wire_zigzag(delta));
+        p = wire_put(p, ntohl((uint32_t)t->hid) ^ addr);
+        p = wire_put(p, (uint32_t)(t->hid >> 32) ^ index);
+        usec = t->usec;
+        addr = ntohl((uint32_t)t->hid);
+        index = (uint32_t)(t->hid >> 32);
+    }
+    return p;
+}
+
+
+static inline char *wire_get_timestamps(char *p, char *end, timestamp_t *timestamps, int count)
+{
+    uint32_t base;
+    uint32_t usec = 0;
+    uint32_t addr = 0;
+    uint32_t index = 0;
+
+    if (!count)
+        return p;
+    if (!(p = wire_get(p, end, &base)))
+        return NULL;
+    for (int i = 0; i < count; i++) {
+        uint32_t sec;
+        uint32_t delta;
+        uint32_t diff;
+        uint32_t next;
+
+        if (!(p = wire_get(p, end, &sec)) || !(p = wire_get(p, end, &delta)) || !(p = wire_get(p, end, &diff))
+            || !(p = wire_get(p, end, &next)))
+            return NULL;
+        usec += wire_unzigzag(delta);
+        addr ^= diff;
+        index ^= next;
+        timestamps[i].sec = base + wire_unzigzag(sec);
+        timestamps[i].usec = usec;
+        timestamps[i].hid = htonl(addr) | ((hid_t)index << 32);
+    }
+    return p;
+}
+
+
+size_t wire_pack(char *buf, session_t session, seq_t *dep, seq_t *prev, int nr_cells, bool full, timestamp_t *timestamps, int count)
+{
+    char *p = buf;
+
+    *p++ = WIRE_VERSION;
+    *p++ = full ? WIRE_FULL : 0;
+    p = wire_put(p, session);
+    p = wire_put(p, count);
+    if (full) {
+        for (int i = 0; i < nr_cells; i++)
+            p = wire_put(p, dep[i]);
+    } else {
+        int n = 0;
+
+        for (int i = 0; i < nr_cells; i++)
+            if (dep[i] != prev[i])
+                n++;
+        p = wire_put(p, n);
+        for (int i = 0; (i < nr_cells) && n; i++) {
+            if (dep[i] != prev[i]) {
+                p = wire_put(p, i);
+                p = wire_put(p, dep[i]);
+                n--;
+            }
+        }
+    }
+    p = wire_put_timestamps(p, timestamps, count);
+    return p - buf;
+}
+
+
+// Decoded cells are stored into dep, which keeps the latest matrix of the sender.
+// The frame is dropped (-ESTALE) without touching dep if it belongs to another session.
+// On input, count is the capacity of timestamps.
+int wire_unpack(char *buf, size_t size, session_t session, seq_t *dep, int nr_cells, timestamp_t *timestamps, int *count)
+{
+    uint32_t n;
+    uint32_t kind;
+    char *p = buf;
+    char *end = buf + size;
+
+    if ((size < 2) || (WIRE_VERSION != (uint8_t)p[0])) {
+        log_debug("invalid frame, size=%zu", size);
+        return -EINVAL;
+    }
+    kind = (uint8_t)p[1];
+    p += 2;
+    if (!(p = wire_get(p, end, &n)))
+        goto invalid;
+    if (n != session) {
+        log_debug("dropped, session=%d (current=%d)", n, session);
+        return -ESTALE;
+    }
+    if (!(p = wire_get(p, end, &n)) || (n > *count))
+        goto invalid;
+    *count = n;
+    if (kind & WIRE_FULL) {
+        for (int i = 0; i < nr_cells; i++)
+            if (!(p = wire_get(p, end, &dep[i])))
+                goto invalid;
+    } else {
+        if (!(p = wire_get(p, end, &n)))
+            goto invalid;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t cell;
+
+            if (!(p = wire_get(p, end, &cell)) || (cell >= nr_cells))
+                goto invalid;
+            if (!(p = wire_get(p, end, &dep[cell])))
+                goto invalid;
+        }
+    }
+    if (!wire_get_timestamps(p, end, timestamps, *count))
+        goto invalid;
+    return 0;
+invalid:
+    log_debug("invalid frame, size=%zu", size);
+    return -EINVAL;
+}
+
+
+size_t wire_pack_nack(char *buf, int target, timestamp_t *timestamps, int count)
+{
+    char *p = buf;
+
+    *p++ = WIRE_VERSION;
+    *p++ = WIRE_NACK;
+    p = wire_put(p, target);
+    p = wire_put(p, count);
+    p = wire_put_timestamps(p, timestamps, count);
+    return p - buf;
+}
+
+
+// Returns the target of a NACK or RETX frame, or -1 if the frame is invalid
+int wire_target(char *buf, size_t size)
+{
+    uint32_t n;
+
+    if ((size < 2) || (WIRE_VERSION != (uint8_t)buf[0]) || !wire_get(buf + 2, buf + size, &n))
+        return -1;
+    return n;
+}
+
+
+// On input, count is the capacity of timestamps.
+int wire_unpack_nack(char *buf, size_t size, timestamp_t *timestamps, int *count)
+{
+    uint32_t n;
+    char *p = buf + 2;
+    char *end = buf + size;
+
+    if ((size < 2) || (WIRE_VERSION != (uint8_t)buf[0]) || (WIRE_NACK != (uint8_t)buf[1]))
+        goto invalid;
+    if (!(p = wire_get(p, end, &n)))
+        goto invalid;
+    if (!(p = wire_get(p, end, &n)) || (n > *count))
+        goto invalid;
+    *count = n;
+    if (!wire_get_timestamps(p, end, timestamps, *count))
+        goto invalid;
+    return 0;
+invalid:
+    log_debug("invalid nack, size=%zu", size);
+    return -EINVAL;
+}
+
+
+size_t wire_retx_size(ref_msg_t **refs, int count)
+{
+    size_t size = WIRE_HEADER_MAX;
+
+    for (int i = 0; i < count; i++) {
+        size += WIRE_VARINT_MAX;
+        for (int j = 0; j < refs[i]->nr_frames; j++)
+            size += WIRE_VARINT_MAX + zframe_size(refs[i]->frames[j]);
+    }
+    return size;
+}
+
+
+// buf has to hold wire_retx_size(refs, count) bytes
+size_t wire_pack_retx(char *buf, int target, ref_msg_t **refs, int count)
+{
+    char *p = buf;
+
+    *p++ = WIRE_VERSION;
+    *p++ = WIRE_RETX;
+    p = wire_put(p, target);
+    p = wire_put(p, count);
+    for (int i = 0; i < count; i++) {
+        ref_msg_t *ref = refs[i];
+
+        p = wire_put(p, ref->nr_frames);
+        for (int j = 0; j < ref->nr_frames; j++) {
+            size_t len = zframe_size(ref->frames[j]);
+
+            p = wire_put(p, len);
+            memcpy(p, zframe_data(ref->frames[j]), len);
+            p += len;
+        }
+    }
+    return p - buf;
+}
+
+
+// Rebuilds n messages from p. On input, count is the capacity of msgs, and
+// the messages are owned by the caller on success. A message starts with
+// its timestamp, so it has at least one frame that can hold one.
+static int wire_get_msgs(char *p, char *end, uint32_t n, zmsg_t **msgs, int *count)
+{
+    int total = 0;
+
+    if (n > *count)
+        return -EINVAL;
+    for (total = 0; total < n; total++) {
+        uint32_t nr_frames;
+
+        if (!(p = wire_get(p, end, &nr_frames)) || !nr_frames || (nr_frames > REF_FRAME_MAX))
+            goto release;
+        msgs[total] = zmsg_new();
+        for (uint32_t i = 0; i < nr_frames; i++) {
+            uint32_t len;
+
+            if (!(p = wire_get(p, end, &len)) || (len > end - p) || (!i && (len < sizeof(timestamp_t)))) {
+                total++;
+                goto release;
+            }
+            zmsg_addmem(msgs[total], p, len);
+            p += len;
+        }
+    }
+    *count = total;
+    return 0;
+release:
+    for (int i = 0; i < total; i++)
+        zmsg_destroy(&msgs[i]);
+    return -EINVAL;
+}
+
+
+int wire_unpack_retx(char *buf, size_t size, zmsg_t **msgs, int *count)
+{
+    uint32_t n;
+    char *p = buf + 2;
+    char *end = buf + size;
+
+    if ((size < 2) || (WIRE_VERSION != (uint8_t)buf[0]) || (WIRE_RETX != (uint8_t)buf[1]))
+        goto invalid;
+    if (!(p = wire_get(p, end, &n)) || !(p = wire_get(p, end, &n)))
+        goto invalid;
+    if (!wire_get_msgs(p, end, n, msgs, count))
+        return 0;
+invalid:
+    log_debug("invalid retx, size=%zu", size);
+    return -EINVAL;
+}
+
+
+size_t wire_msg_size(zmsg_t *msg)
+{
+    size_t size = WIRE_VARINT_MAX;
+
+    for (zframe_t *frame = zmsg_first(msg); frame; frame = zmsg_next(msg))
+        size += WIRE_VARINT_MAX + zframe_size(frame);
+    return size;
+}
+
+
+// p has to hold wire_msg_size(msg) bytes
+char *wire_put_msg(char *p, zmsg_t *msg)
+{
+    p = wire_put(p, zmsg_size(msg));
+    for (zframe_t *frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        size_t len = zframe_size(frame);
+
+        p = wire_put(p, len);
+        memcpy(p, zframe_data(frame), len);
+        p += len;
+    }
+    return p;
+}
+
+
+// Writes the header of a REQUESTS frame, which takes at most WIRE_HEADER_MAX
+// bytes and is followed by count messages put with wire_put_msg.
+size_t wire_pack_requests(char *buf, int count)
+{
+    char *p = buf;
+
+    *p++ = WIRE_VERSION;
+    *p++ = WIRE_REQUESTS;
+    p = wire_put(p, count);
+    return p - buf;
+}
+
+
+int wire_unpack_requests(char *buf, size_t size, zmsg_t **msgs, int *count)
+{
+    uint32_t n;
+    char *p = buf + 2;
+    char *end = buf + size;
+
+    if ((size < 2) || (WIRE_VERSION != (uint8_t)buf[0]) || (WIRE_REQUESTS != (uint8_t)buf[1]))
+        goto invalid;
+    if (!(p = wire_get(p, end, &n)))
+        goto invalid;
+    if (!wire_get_msgs(p, end, n, msgs, count))
+        return 0;
+invalid:
+    log_debug("invalid requests, size=%zu", size);
+    return -EINVAL;
+}
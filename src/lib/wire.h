@@ -0,0 +1,34 @@
+#ifndef _WIRE_H
+#define _WIRE_H
+
+#include <tbc.h>
+
+#define WIRE_VERSION    2
+#define WIRE_FULL       0x01   // the frame carries every cell of the dep matrix
+#define WIRE_NACK       0x02   // the frame asks the target for the messages of some timestamps
+#define WIRE_RETX       0x04   // the frame carries messages retransmitted to the target
+#define WIRE_REQUESTS   0x08   // the frame carries the requests coalesced by a client
+#define WIRE_VARINT_MAX 5      // bytes
+#define WIRE_HEADER_MAX (2 + 2 * WIRE_VARINT_MAX)
+#define WIRE_CELL_MAX   (2 * WIRE_VARINT_MAX)
+#define WIRE_ENTRY_MAX  (4 * WIRE_VARINT_MAX)
+#define wire_size_max(nr_cells, count) (WIRE_HEADER_MAX + WIRE_VARINT_MAX + (nr_cells) * WIRE_CELL_MAX + WIRE_VARINT_MAX + (count) * WIRE_ENTRY_MAX)
+#define wire_nack_size_max(count) (WIRE_HEADER_MAX + WIRE_VARINT_MAX + (count) * WIRE_ENTRY_MAX)
+#define wire_kind(buf, size) ((size) >= 2 ? (uint8_t)(buf)[1] : 0)
+
+struct ref_msg;
+
+size_t wire_pack(char *buf, session_t session, seq_t *dep, seq_t *prev, int nr_cells, bool full, timestamp_t *timestamps, int count);
+int wire_unpack(char *buf, size_t size, session_t session, seq_t *dep, int nr_cells, timestamp_t *timestamps, int *count);
+size_t wire_pack_nack(char *buf, int target, timestamp_t *timestamps, int count);
+int wire_target(char *buf, size_t size);
+int wire_unpack_nack(char *buf, size_t size, timestamp_t *timestamps, int *count);
+size_t wire_retx_size(struct ref_msg **refs, int count);
+size_t wire_pack_retx(char *buf, int target, struct ref_msg **refs, int count);
+int wire_unpack_retx(char *buf, size_t size, zmsg_t **msgs, int *count);
+size_t wire_msg_size(zmsg_t *msg);
+char *wire_put_msg(char *p, zmsg_t *msg);
+size_t wire_pack_requests(char *buf, int count);
+int wire_unpack_requests(char *buf, size_t size, zmsg_t **msgs, int *count);
+
+#endif
@@ -9,6 +9,8 @@
 #include "generator.h"
 #include "client.h"
 #include "parser.h"
+#include "timer.h"
+#include "outbox.h"
 #include "util.h"
 #include "log.h"
 
@@ -38,6 +40,8 @@ int main(int argc, char **argv)
     eval_intv = EVAL_INTV;
     strcpy(log_name, PATH_LOG);
     check_settings();
+    timer_init();
+    outbox_init();
 #ifdef FUNC_TIMER
     init_func_timer();
 #endif
@@ -1,4 +1,10 @@
 #include "ev.h"
+#include "pool.h"
+#include "ring.h"
+#include "timer.h"
+#include "outbox.h"
+#include "completion.h"
+#include "flow.h"
 #include "queue.h"
 #include "batch.h"
 #include "record.h"
@@ -10,7 +16,8 @@
 #include "evaluator.h"
 #include "tracker.h"
 
-#define TRACKER_CHECK_INTV 5000000 // nsec
+#define TRACKER_CHECK_INTV 5000000000 // nsec
+#define TRACKER_OUTPUT_MAX 64
 #define TRACKER_QUEUE_CHECKER
 #define TRACKER_IGNORE
 
@@ -27,7 +34,14 @@ typedef struct tracker_entry {
 
 struct {
     bool busy;
+    bool stalled;
+    ev_t ev_handle;
+    ev_t ev_reclaim;
     ev_t ev_deliver;
+    ev_t ev_monitor;
+    ring_t handled;
+    ring_t delivered;
+    unsigned long pending;
     pthread_mutex_t mutex;
     ev_t ev_live[NODE_MAX];
     struct list_head output;
@@ -93,6 +107,7 @@ void tracker_deliver(record_t *record)
         if (list_empty(&tracker_status.output))
             wakeup = true;
         tracker_list_add_tail(&record->output, &tracker_status.output);
+        tracker_status.pending++;
         tracker_deliver_cnt++;
         show_deliver(record, tracker_deliver_cnt);
     }
@@ -112,16 +127,16 @@ static inline void tracker_check_queue(int id, struct list_head *head, struct li
         struct list_head *candidates = &tracker_status.candidates[id];
 
         while (pos != candidates) {
-            rec = list_entry(pos, record_t, cand[id]);
-            checked = &rec->checked[id];
+            rec = record_entry(pos, id, cand);
+            checked = &rec->links[id].checked;
             if (!is_delivered(rec)) {
                 empty = is_empty(checked);
                 if (!ignore)
                     tracker_ignore(rec);
                 if (empty && rec->ignore) {
                     tracker_list_add(checked, head);
-                    if (!rec->prev[id] && !rec->count[id]) {
-                        rec->count[id] = true;
+                    if (!rec->links[id].prev && !rec->links[id].count) {
+                        rec->links[id].count = true;
                         rec->perceived++;
                         if (tracker_can_deliver(rec)) {
                             tracker_deliver(rec);
@@ -135,8 +150,8 @@ static inline void tracker_check_queue(int id, struct list_head *head, struct li
                 head = checked;
             pos = pos->next;
         }
-        if ((pos != candidates) && empty && !rec->count[id] && !rec->prev[id]) {
-            rec->count[id] = true;
+        if ((pos != candidates) && empty && !rec->links[id].count && !rec->links[id].prev) {
+            rec->links[id].count = true;
             rec->perceived++;
             if (tracker_can_deliver(rec))
                 tracker_deliver(rec);
@@ -149,7 +164,7 @@ static inline void tracker_check(record_t *record)
 {
     if (!record->ignore && ((record->receivers & available_nodes) == available_nodes)) {
         for (int id = 0; id < nr_nodes; id++) {
-            struct list_head *cand = &record->cand[id];
+            struct list_head *cand = &record->links[id].cand;
 
             if (is_valid(cand)) {
                 struct list_head *head = NULL;
@@ -157,20 +172,20 @@ static inline void tracker_check(record_t *record)
                 struct list_head *candidates = &tracker_status.candidates[id];
 
                 if (prev != candidates) {
-                    record_t *rec = list_entry(prev, record_t, cand[id]);
+                    record_t *rec = record_entry(prev, id, cand);
 
-                    head = &rec->checked[id];
+                    head = &rec->links[id].checked;
                     if (is_empty(head)) {
                         head = NULL;
                         if (is_delivered(rec)) {
                             prev = prev->prev;
                             while (prev != candidates) {
-                                rec = list_entry(prev, record_t, cand[id]);
+                                rec = record_entry(prev, id, cand);
                                 if (is_delivered(rec))
                                     prev = prev->prev;
                                 else {
-                                    if (is_valid(&rec->checked[id]))
-                                        head = &rec->checked[id];
+                                    if (is_valid(&rec->links[id].checked))
+                                        head = &rec->links[id].checked;
                                     break;
                                 }
                             }
@@ -183,7 +198,7 @@ static inline void tracker_check(record_t *record)
 
                 if (head) {
                     struct list_head *pos = cand->next;
-                    struct list_head *checked = &record->checked[id];
+                    struct list_head *checked = &record->links[id].checked;
 
                     assert(is_empty(checked));
                     tracker_list_add(checked, head);
@@ -202,8 +217,8 @@ void tracker_check_receivers(int id, record_t *record)
     bool valid = true;
     struct list_head *last;
 
-    if (is_empty(&record->cand[id])) {
-        struct list_head *input = &record->input[id];
+    if (is_empty(&record->links[id].cand)) {
+        struct list_head *input = &record->links[id].input;
 
         assert(is_empty(input));
         tracker_list_add_tail(input, &tracker_status.input[id]);
@@ -211,19 +226,19 @@ void tracker_check_receivers(int id, record_t *record)
         return;
     }
     tracker_mutex_lock();
-    if (is_valid(&record->input[id]))
+    if (is_valid(&record->links[id].input))
         record->receivers |= node_mask[id];
-    last = record->cand[id].prev;
+    last = record->links[id].cand.prev;
     assert(last);
     if (last != &tracker_status.candidates[id]) {
-        record_t *rec = list_entry(last, record_t, cand[id]);
+        record_t *rec = record_entry(last, id, cand);
 
-        valid = rec->count[id] || is_valid(&rec->checked[id]);
+        valid = rec->links[id].count || is_valid(&rec->links[id].checked);
         if (!valid)
             show_blocker(id, rec, record);
     }
-    if (valid && !record->count[id]) {
-        record->count[id] = true;
+    if (valid && !record->links[id].count) {
+        record->links[id].count = true;
         record->perceived++;
         if (record->perceived >= majority)
             if (!is_delivered(record))
@@ -238,11 +253,11 @@ void tracker_check_receivers(int id, record_t *record)
 
 inline bool tracker_check_next(int id, record_t *rec_next, record_t *rec_prev)
 {
-    bool valid = rec_prev ? (is_valid(&rec_prev->checked[id]) || rec_prev->count[id]) : true;
+    bool valid = rec_prev ? (is_valid(&rec_prev->links[id].checked) || rec_prev->links[id].count) : true;
 
     tracker_ignore(rec_next);
-    if (valid && !rec_next->count[id] && !rec_next->prev[id]) {
-        rec_next->count[id] = true;
+    if (valid && !rec_next->links[id].count && !rec_next->links[id].prev) {
+        rec_next->links[id].count = true;
         rec_next->perceived++;
         if (tracker_can_deliver(rec_next))
             tracker_deliver(rec_next);
@@ -256,19 +271,19 @@ void tracker_delete_entry(int id, record_t *record)
 {
     record_t *rec_next = NULL;
     record_t *rec_prev = NULL;
-    record_t *pprev = record->prev[id];
-    struct list_head *req = &record->req[id];
-    struct list_head *cand = &record->cand[id];
-    struct list_head *next = &record->next[id];
-    struct list_head *input = &record->input[id];
-    struct list_head *checked = &record->checked[id];
+    record_t *pprev = record->links[id].prev;
+    struct list_head *req = &record->links[id].req;
+    struct list_head *cand = &record->links[id].cand;
+    struct list_head *next = &record->links[id].next;
+    struct list_head *input = &record->links[id].input;
+    struct list_head *checked = &record->links[id].checked;
     struct list_head *head = &tracker_status.checked[id];
     struct list_head *candidates = &tracker_status.candidates[id];
 
     show_dequeue(id, record->timestamp);
     if (pprev) {
         assert(timestamp_compare(pprev->timestamp, record->timestamp) < 0);
-        tracker_list_del(&record->link[id]);
+        tracker_list_del(&record->links[id].link);
     }
     if (is_valid(next) && !list_empty(next)) {
         struct list_head *i;
@@ -276,7 +291,7 @@ void tracker_delete_entry(int id, record_t *record)
         record_t *prev = NULL;
 
         for (i = next->next, j = i->next; i != next; i = j, j = j->next) {
-            record_t *rec = list_entry(i, record_t, link[id]);
+            record_t *rec = record_entry(i, id, link);
 
             prev = queue_update_prev(id, record, rec);
             if (pprev && !prev) {
@@ -284,17 +299,17 @@ void tracker_delete_entry(int id, record_t *record)
                 log_err("failed to find prev item");
             }
             if (prev) {
-                struct list_head *prev_next = &prev->next[id];
+                struct list_head *prev_next = &prev->links[id].next;
 
                 if (is_empty(prev_next))
                     tracker_list_head_init(prev_next, i);
                 else
                     tracker_list_add_tail(i, prev_next);
-                rec->prev[id] = prev;
+                rec->links[id].prev = prev;
                 show_prev(id, rec, prev, record);
             } else {
                 set_empty(i);
-                rec->prev[id] = NULL;
+                rec->links[id].prev = NULL;
                 show_prev(id, rec, NULL, record);
                 tracker_check_receivers(id, rec);
             }
@@ -302,19 +317,19 @@ void tracker_delete_entry(int id, record_t *record)
     }
     if (is_valid(cand)) {
         if (cand->next != candidates)
-            rec_next = list_entry(cand->next, record_t, cand[id]);
+            rec_next = record_entry(cand->next, id, cand);
         if (cand->prev != candidates)
-            rec_prev = list_entry(cand->prev, record_t, cand[id]);
+            rec_prev = record_entry(cand->prev, id, cand);
     }
     tracker_mutex_lock();
     if (rec_prev)
-        head = &rec_prev->checked[id];
+        head = &rec_prev->links[id].checked;
     if (is_valid(checked))
         tracker_list_del(checked);
     if (rec_next) {
         tracker_check_next(id, rec_next, rec_prev);
         if (is_valid(head))
-            tracker_check_queue(id, head, &rec_next->cand[id], true);
+            tracker_check_queue(id, head, &rec_next->links[id].cand, true);
     }
     if (is_valid(cand))
         tracker_list_del(cand);
@@ -333,50 +348,65 @@ void tracker_update_queue(int id, record_t *record)
 
     show_enqueue(id, record->timestamp);
     queue_push(id, record, &earliest);
-    tracker_list_add_tail(&record->req[id], &tracker_status.req_list[id]);
+    tracker_list_add_tail(&record->links[id].req, &tracker_status.req_list[id]);
     if (earliest) {
-        tracker_list_add_tail(&record->input[id],  &tracker_status.input[id]);
+        tracker_list_add_tail(&record->links[id].input,  &tracker_status.input[id]);
         tracker_wakeup();
     }
 }
 
 
-static inline record_t *tracker_do_check_output()
+// Takes at most max delivered records under a single lock acquisition
+static inline int tracker_do_check_output(record_t **records, int max)
 {
-    record_t *record = NULL;
+    int count = 0;
+    struct list_head *output = &tracker_status.output;
 
     tracker_deliver_lock();
-    if (!list_empty(&tracker_status.output)) {
-        struct list_head *head = tracker_status.output.next;
+    while ((count < max) && !list_empty(output)) {
+        struct list_head *head = output->next;
 
-        record = list_entry(head, record_t, output);
+        records[count++] = list_entry(head, record_t, output);
         tracker_list_del(head);
     }
+    tracker_status.pending -= count;
     tracker_deliver_unlock();
-    return record;
+    return count;
 }
 
 
+// The ordering stage takes delivered records off every queue and hands
+// them over to the delivery stage.
 bool tracker_check_output()
 {
-    record_t *rec = tracker_do_check_output();
-
-    if (rec) {
-        hid_t hid;
-        timeval_t t;
-        zmsg_t *msg = rec->msg;
-        zframe_t *frame = zmsg_last(msg);
-        size_t size = zframe_size(frame);
-        char *buf = (char *)zframe_data(frame);
-
-        for (int i = 0; i < nr_nodes; i++) {
-            tracker_lock(i);
-            if (!is_empty(&rec->item_list[i]))
-                tracker_delete_entry(i, rec);
-            tracker_unlock(i);
+    int count;
+    ring_t *ring = &tracker_status.delivered;
+    unsigned long space = ring_space(ring);
+    record_t *records[TRACKER_OUTPUT_MAX];
+
+    if (!space) {
+        __atomic_store_n(&tracker_status.stalled, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // the deliverer may have drained the ring before the flag was set
+        space = ring_space(ring);
+        if (!space)
+            return false;
+    }
+    count = tracker_do_check_output(records, space < TRACKER_OUTPUT_MAX ? space : TRACKER_OUTPUT_MAX);
+    for (int i = 0; i < count; i++) {
+        record_t *rec = records[i];
+
+        for (int j = 0; j < nr_nodes; j++) {
+            tracker_lock(j);
+            if (queue_is_member(j, rec))
+                tracker_delete_entry(j, rec);
+            tracker_unlock(j);
         }
-        handle(buf, size);
-        record_release(rec);
+        if (!ring_push(ring, rec))
+            log_err("failed to push");
+    }
+    if (count) {
+        ev_set(&tracker_status.ev_handle);
         return true;
     } else
         return false;
@@ -400,13 +430,13 @@ bool tracker_check_input()
         if (!list_empty(req_list)) {
             tracker_mutex_lock();
             for (i = req_list->next, j = i->next; i != req_list; i = j, j = j->next) {
-                record_t *rec = list_entry(i, record_t, req[id]);
+                record_t *rec = record_entry(i, id, req);
 
-                if (is_empty(&rec->input[id]))
+                if (is_empty(&rec->links[id].input))
                     rec->receivers |= mask;
 
                 if (!is_delivered(rec)) {
-                    tracker_list_add_tail(&rec->cand[id], candidates);
+                    tracker_list_add_tail(&rec->links[id].cand, candidates);
                     if (rec->perceived < majority)
                         tracker_check(rec);
                 }
@@ -417,7 +447,7 @@ bool tracker_check_input()
         }
         if (!list_empty(input)) {
             for (i = input->next, j = i->next; i != input; i = j, j = j->next) {
-                record_t *rec = list_entry(i, record_t, input[id]);
+                record_t *rec = record_entry(i, id, input);
 
                 if (!is_delivered(rec))
                     tracker_check_receivers(id, rec);
@@ -434,7 +464,7 @@ bool tracker_check_input()
 static inline void tracker_put(int id, record_t *record)
 {
     track_enter();
-    if (is_empty(&record->item_list[id]))
+    if (!queue_is_member(id, record))
         tracker_update_queue(id, record);
     track_exit();
 }
@@ -446,11 +476,8 @@ static inline void tracker_do_update(int id, timestamp_t *timestamp, zmsg_t *msg
     if (timestamp_check(timestamp)) {
         record_t *rec = record_find(id, timestamp, msg);
 
-        if (rec) {
-            if (!is_delivered(rec))
-                tracker_put(id, rec);
-            record_put(id, rec);
-        }
+        if (rec && !is_delivered(rec))
+            tracker_put(id, rec);
     }
     track_exit();
 }
@@ -478,8 +505,15 @@ int tracker_init()
     }
     queue_init();
     tracker_status.busy = false;
+    tracker_status.stalled = false;
+    tracker_status.pending = 0;
     INIT_LIST_HEAD(&tracker_status.output);
+    ring_init(&tracker_status.handled);
+    ring_init(&tracker_status.delivered);
+    ev_init(&tracker_status.ev_handle, DELIVER_TIMEOUT);
+    ev_init(&tracker_status.ev_reclaim, DELIVER_TIMEOUT);
     ev_init(&tracker_status.ev_deliver, DELIVER_TIMEOUT);
+    ev_init(&tracker_status.ev_monitor, EV_NOTIMEOUT);
     for (int i = 0; i < NODE_MAX; i++) {
         INIT_LIST_HEAD(&tracker_status.checked[i]);
         INIT_LIST_HEAD(&tracker_status.input[i]);
@@ -695,68 +729,167 @@ void *tracker_handler(void *arg)
 }
 
 
+// The delivery stage hands the application every record available in
+// the ring as one ordered batch.
+void *tracker_deliverer(void *arg)
+{
+    record_t *records[TRACKER_OUTPUT_MAX];
+    request_t requests[TRACKER_OUTPUT_MAX];
+
+    while (true) {
+        int count = 0;
+        record_t *rec = NULL;
+
+        while ((count < TRACKER_OUTPUT_MAX) && (rec = ring_pop(&tracker_status.delivered))) {
+            zframe_t *frame = zmsg_last(rec->msg);
+
+            requests[count].buf = (char *)zframe_data(frame);
+            requests[count].size = zframe_size(frame);
+            requests[count].timestamp = rec->timestamp;
+            records[count] = rec;
+            count++;
+        }
+        if (count) {
+            handle_batch(requests, count);
+            for (int i = 0; i < count; i++) {
+                while (!ring_push(&tracker_status.handled, records[i])) {
+                    ev_set(&tracker_status.ev_reclaim);
+                    sched_yield();
+                }
+            }
+            ev_set(&tracker_status.ev_reclaim);
+            if (__atomic_exchange_n(&tracker_status.stalled, false, __ATOMIC_SEQ_CST))
+                tracker_wakeup();
+        } else
+            ev_wait(&tracker_status.ev_handle);
+#ifdef FLOW
+        flow_advertise();
+#endif
+    }
+}
+
+
+#ifdef FLOW
+// Wakes up the deliverer to advertise the credits when it is idle
+void tracker_advertise(void *arg)
+{
+    ev_set(&tracker_status.ev_handle);
+}
+#endif
+
+
+// The reclamation stage releases the records whose callbacks have returned,
+// and retires them to the recycler once per batch.
+void *tracker_reclaimer(void *arg)
+{
+    while (true) {
+        int count = 0;
+        record_t *rec = NULL;
+
+        while ((count < TRACKER_OUTPUT_MAX) && (rec = ring_pop(&tracker_status.handled))) {
+            record_release(rec);
+            count++;
+        }
+        if (count)
+            record_retire();
+        else
+            ev_wait(&tracker_status.ev_reclaim);
+    }
+}
+
+
 void tracker_create_handler()
 {
     pthread_t thread;
     pthread_attr_t attr;
 
+#ifdef COMPLETION
+    completion_init();
+#endif
+#ifdef FLOW
+    timer_add(tracker_advertise, NULL, FLOW_INTV);
+#endif
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    pthread_create(&thread, &attr, tracker_reclaimer, NULL);
+    pthread_create(&thread, &attr, tracker_deliverer, NULL);
     pthread_create(&thread, &attr, tracker_handler, NULL);
 }
 
 
-void *tracker_monitor(void *arg)
+// Runs on the timer, which must not block, so the scan under the tracker
+// mutex is left to the monitor
+void tracker_monitor_tick(void *arg)
 {
-    while (true) {
-        usleep(TRACKER_CHECK_INTV);
-        if (tracker_status.busy)
-            tracker_status.busy = false;
-        else {
-            bool show = false;
-
-            for (int id = 0; id < nr_nodes; id++) {
-                bool deliver = false;
-                struct list_head *pos;
-                struct list_head *head = &tracker_status.checked[id];
-                struct list_head *candidates = &tracker_status.candidates[id];
+    ev_set(&tracker_status.ev_monitor);
+}
 
-                tracker_mutex_lock();
-                for (pos = candidates->next; pos != candidates; pos = pos->next) {
-                    record_t *rec = list_entry(pos, record_t, cand[id]);
-
-                    if (!is_delivered(rec)) {
-                        if (!rec->prev[id] && !rec->count[id]) {
-                            rec->count[id] = true;
-                            rec->perceived++;
-                            if (tracker_can_deliver(rec)) {
-                                tracker_deliver(rec);
-                                deliver = true;
-                                break;
-                            }
-                        }
-                        if (is_empty(&rec->checked[id]))
+
+void tracker_monitor_check()
+{
+    show_pool();
+    batch_show_stat();
+    show_pipeline(tracker_status.pending, ring_depth(&tracker_status.delivered), ring_depth(&tracker_status.handled));
+    show_ev("deliver", &tracker_status.ev_deliver);
+    show_ev("handle", &tracker_status.ev_handle);
+    show_ev("reclaim", &tracker_status.ev_reclaim);
+    outbox_show_stat();
+    if (tracker_status.busy)
+        tracker_status.busy = false;
+    else {
+        bool show = false;
+
+        for (int id = 0; id < nr_nodes; id++) {
+            bool deliver = false;
+            struct list_head *pos;
+            struct list_head *head = &tracker_status.checked[id];
+            struct list_head *candidates = &tracker_status.candidates[id];
+
+            tracker_mutex_lock();
+            for (pos = candidates->next; pos != candidates; pos = pos->next) {
+                record_t *rec = record_entry(pos, id, cand);
+
+                if (!is_delivered(rec)) {
+                    if (!rec->links[id].prev && !rec->links[id].count) {
+                        rec->links[id].count = true;
+                        rec->perceived++;
+                        if (tracker_can_deliver(rec)) {
+                            tracker_deliver(rec);
+                            deliver = true;
                             break;
+                        }
                     }
+                    if (is_empty(&rec->links[id].checked))
+                        break;
                 }
-                if (!deliver) {
-                    if (!list_empty(head)) {
-                        record_t *rec = list_entry(head->prev, record_t, checked[id]);
-
-                        pos = rec->cand[id].next;
-                        head = head->prev;
-                        show = true;
-                    } else
-                        pos = candidates->next;
-                    tracker_check_queue(id, head, pos, false);
-                }
-                tracker_mutex_unlock();
             }
-            if (show)
-                show_status();
+            if (!deliver) {
+                if (!list_empty(head)) {
+                    record_t *rec = record_entry(head->prev, id, checked);
+
+                    pos = rec->links[id].cand.next;
+                    head = head->prev;
+                    show = true;
+                } else
+                    pos = candidates->next;
+                tracker_check_queue(id, head, pos, false);
+            }
+            tracker_mutex_unlock();
         }
+        if (show)
+            show_status();
+    }
+}
+
+
+void *tracker_monitor(void *arg)
+{
+    while (true) {
+        ev_wait(&tracker_status.ev_monitor);
+        tracker_monitor_check();
     }
+    return NULL;
 }
 
 
@@ -769,6 +902,8 @@ void tracker_create_queue_checker()
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
     pthread_create(&thread, &attr, tracker_monitor, NULL);
+    pthread_attr_destroy(&attr);
+    timer_add(tracker_monitor_tick, NULL, TRACKER_CHECK_INTV);
 }
 
 
@@ -795,6 +930,8 @@ int tracker_create()
 
 bool tracker_is_empty()
 {
+    if (tracker_status.pending || ring_depth(&tracker_status.delivered) || ring_depth(&tracker_status.handled))
+        return false;
     for (int i = 0; i < nr_nodes; i++) {
         tracker_lock(i);
         bool empty = (queue_length(i) == 0);
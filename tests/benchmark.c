@@ -20,11 +20,12 @@ struct in_addr get_addr()
 }
 
 
-hid_t get_hid()
+// The same hid as client thread index of tbc on this host
+hid_t get_hid(int index)
 {
     struct in_addr addr = get_addr();
 
-    return (hid_t)addr.s_addr;
+    return (hid_t)addr.s_addr ^ htonl((uint32_t)index << 24);
 }
 
 
@@ -34,7 +35,9 @@ int main(int argc, char **argv)
     char *buf;
     int cnt = 0;
     int opt = 0;
+    int index = 0;
     void *socket;
+    char addr[256];
     void *context;
     int count = NR_PACKETS;
     int hwm = HIGH_WATER_MARK;
@@ -42,7 +45,7 @@ int main(int argc, char **argv)
     hdr_t *hdr;
 
     if (argc > 0) {
-        while ((opt = getopt(argc, argv, "s:r:")) != -1) {
+        while ((opt = getopt(argc, argv, "s:r:c:")) != -1) {
             switch(opt) {
             case 's':
                 size = strtol(optarg, NULL, 10);
@@ -50,8 +53,11 @@ int main(int argc, char **argv)
             case 'r':
                 count = strtol(optarg, NULL, 10);
                 break;
+            case 'c':
+                index = strtol(optarg, NULL, 10);
+                break;
             default:
-                printf("Usage: %s [-s size] [-r requests]\n", argv[0]);
+                printf("Usage: %s [-s size] [-r requests] [-c client]\n", argv[0]);
                 exit(-1);
             }
         }
@@ -60,19 +66,23 @@ int main(int argc, char **argv)
         printf("Error: the packet size should be greater than %lu bytes\n", sizeof(hdr_t));
         return -1;
     }
-    printf("benchmark: size=%zu, requests=%d\n", size, count);
+    if (index)
+        sprintf(addr, "%s_%d", ADDR, index);
+    else
+        strcpy(addr, ADDR);
+    printf("benchmark: size=%zu, requests=%d, client=%d\n", size, count, index);
     buf = malloc(size);
     if (!buf) {
         printf("Error: no memory\n");
         exit(-1);
     }
     hdr = (hdr_t *)buf;
-    hdr->hid = get_hid();
+    hdr->hid = get_hid(index);
     context = zmq_ctx_new();
     socket = zmq_socket(context, ZMQ_PUSH);
     if (hwm)
         zmq_setsockopt(socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
-    zmq_connect(socket, ADDR);
+    zmq_connect(socket, addr);
     for (int i = 0; i < count; i++) {
         zmsg_t *msg;
         zframe_t *frame;
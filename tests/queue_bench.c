@@ -0,0 +1,168 @@
+#include <time.h>
+#include <stdio.h>
+#include <getopt.h>
+#include "pool.h"
+#include "queue.h"
+
+#define NR_RECORDS  1000000
+#define WINDOW      10000
+#define NR_HOSTS    8
+#define JITTER      200
+#define REORDER     64
+
+int nr_nodes = 1;
+bool quiet = true;
+
+static int lowest;
+static bool *popped;
+static char *records;
+static timestamp_t *timestamps;
+
+#define bench_record(i) ((record_t *)(records + (size_t)(i) * record_size()))
+
+static unsigned long bench_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+
+// The latest live record arrived before end with a smaller timestamp
+static record_t *bench_scan(int end, timestamp_t *timestamp)
+{
+    for (int i = end - 1; i >= lowest; i--)
+        if (!popped[i] && (timestamp_compare(&timestamps[i], timestamp) < 0))
+            return bench_record(i);
+    return NULL;
+}
+
+
+static void bench_check(record_t *rec, record_t *prev, record_t *expected)
+{
+    if (prev != expected) {
+        printf("Error: wrong prev for %u.%06u (hid=%u)\n", rec->timestamp->sec, rec->timestamp->usec, rec->timestamp->hid);
+        exit(-1);
+    }
+}
+
+
+// Relink the successors of a record before popping it, as the tracker does
+static void bench_pop(int n, bool verify)
+{
+    record_t *record = bench_record(n);
+    struct list_head *next = &record->links[0].next;
+
+    if (record->links[0].prev) {
+        list_del(&record->links[0].link);
+        set_empty(&record->links[0].link);
+    }
+    if (is_valid(next) && !list_empty(next)) {
+        struct list_head *i;
+        struct list_head *j;
+
+        for (i = next->next, j = i->next; i != next; i = j, j = j->next) {
+            record_t *rec = record_entry(i, 0, link);
+            record_t *prev = queue_update_prev(0, record, rec);
+
+            if (verify)
+                bench_check(rec, prev, bench_scan(n, rec->timestamp));
+            list_del(i);
+            if (prev) {
+                struct list_head *prev_next = &prev->links[0].next;
+
+                if (is_empty(prev_next))
+                    INIT_LIST_HEAD(prev_next);
+                list_add_tail(i, prev_next);
+            } else
+                set_empty(i);
+            rec->links[0].prev = prev;
+        }
+    }
+    queue_pop(0, record);
+    popped[n] = true;
+    while (popped[lowest])
+        lowest++;
+}
+
+
+static void bench_init(int count)
+{
+    unsigned long usec = 0;
+    unsigned long last[NR_HOSTS] = {0};
+
+    records = calloc(count, record_size());
+    popped = calloc(count + 1, sizeof(bool));
+    timestamps = calloc(count, sizeof(timestamp_t));
+    if (!records || !popped || !timestamps) {
+        printf("Error: no memory\n");
+        exit(-1);
+    }
+    for (int i = 0; i < count; i++) {
+        int host = rand() % NR_HOSTS;
+        unsigned long t = usec + rand() % JITTER;
+
+        // each host has a monotonic clock, so timestamps never repeat
+        if (t <= last[host])
+            t = last[host] + 1;
+        last[host] = t;
+        timestamps[i].sec = t / 1000000;
+        timestamps[i].usec = t % 1000000;
+        timestamps[i].hid = host + 1;
+        bench_record(i)->timestamp = &timestamps[i];
+        usec++;
+    }
+    queue_init();
+}
+
+
+int main(int argc, char **argv)
+{
+    int opt;
+    bool verify = false;
+    unsigned long start;
+    unsigned long end;
+    int window = WINDOW;
+    int count = NR_RECORDS;
+
+    while ((opt = getopt(argc, argv, "r:w:v")) != -1) {
+        switch(opt) {
+        case 'r':
+            count = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            window = strtol(optarg, NULL, 10);
+            break;
+        case 'v':
+            verify = true;
+            break;
+        default:
+            printf("Usage: %s [-r records] [-w window] [-v]\n", argv[0]);
+            exit(-1);
+        }
+    }
+    srand(1);
+    bench_init(count);
+    start = bench_now();
+    for (int i = 0; i < count; i++) {
+        bool earliest = false;
+        record_t *rec = bench_record(i);
+
+        queue_push(0, rec, &earliest);
+        if (verify)
+            bench_check(rec, rec->links[0].prev, bench_scan(i, rec->timestamp));
+        if (queue_length(0) > window) {
+            int n = lowest + rand() % REORDER;
+
+            if ((n >= i) || popped[n])
+                n = lowest;
+            bench_pop(n, verify);
+        }
+    }
+    while (lowest < count)
+        bench_pop(lowest, verify);
+    end = bench_now();
+    printf("records=%d, window=%d, %.1f nsec/record%s\n", count, window, (double)(end - start) / count, verify ? " (verified)" : "");
+    return 0;
+}